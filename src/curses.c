@@ -1,11 +1,23 @@
 #include "strings.h"
+#include "output.h"
 #include <curses.h>
 #include <lua.h>
 #include <lauxlib.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <locale.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <wchar.h>
 
 #define REG_TABLE "luancurses"
+#define CELLBUF_TABLE "luancurses.cellbuf"
+#define WINDOW_TABLE "luancurses.window"
+#define SCREEN_TABLE "luancurses.screen"
+#define DRAWLIST_TABLE "luancurses.drawlist"
 
 #define NO_ARG_FUNCTION(name) \
 static int l_##name(lua_State* L) \
@@ -14,41 +26,670 @@ static int l_##name(lua_State* L) \
     return 1; \
 }
 
+#define WINDOW_FUNCTION(name) \
+static int l_##name(lua_State* L) \
+{ \
+    int arg = 1; \
+    WINDOW* win; \
+    win = get_window(L, &arg); \
+    lua_pushboolean(L, w##name(win) == OK); \
+    return 1; \
+}
+
 typedef struct _pos {
     int x;
     int y;
 } pos;
 
-static int ncolors = 0, ncolor_pairs = 0, default_color_available = 0;
+typedef struct _window {
+    WINDOW* win;
+    int owned; /* whether we should delwin it when it is collected */
+    int is_pad;
+    /* for pads, the last viewport given to prefresh: pminrow, pmincol,
+     * sminrow, smincol, smaxrow, smaxcol */
+    int view[6];
+    int view_moved;
+} window;
+
+typedef struct _cellbuf {
+    int w;
+    int h;
+    chtype* cells;
+} cellbuf;
+
+/* a recorded drawing operation (see drawlist). strings are kept in the
+ * list's text buffer, as an offset and length */
+typedef struct _dl_op {
+    int type;
+    int has_pos;
+    int has_style;
+    int y;
+    int x;
+    int h;
+    int w;
+    chtype style;
+    chtype ch;
+    size_t text;
+    size_t len;
+    int ascii;
+    unsigned long pin; /* the pair pool generation the style was pinned in */
+} dl_op;
+
+typedef struct _drawlist {
+    struct _screen* scr; /* the screen the styles' pairs belong to */
+    dl_op* ops;
+    int nops;
+    int max_ops;
+    char* text;
+    size_t text_len;
+    size_t text_size;
+} drawlist;
+
+/* dynamic color pairs: pairs which are allocated on demand for a given
+ * foreground/background combination, rather than being named with init_pair.
+ * they are handed out from the top of the pair range downwards (named pairs
+ * grow upwards from the bottom), and once the range is exhausted the least
+ * recently used dynamic pair is reinitialized with the new colors. note that
+ * this changes the colors of anything still on the screen using the evicted
+ * pair. pairs which have been handed out as numbers (by style, alloc_pair or
+ * a drawlist) are pinned instead, since the number will go on being used
+ * without us seeing it, and aren't evicted until every pin has been dropped
+ * again (by free_pair, or when the drawlist is cleared or collected).
+ *
+ * styles are chtypes, which only have room for pair numbers up to 255 in
+ * their A_COLOR bits, so that is as far as the pool goes. init_extended_pair
+ * would let ncurses set up more, but there would be no way to draw with them
+ * short of passing the pair separately everywhere a style goes. */
+typedef struct _dyn_pair {
+    int fg;
+    int bg;
+    int in_use;
+    int pins; /* pinned pairs aren't on the LRU list */
+    int prev;  /* LRU list, most recently used first */
+    int next;
+    int hnext; /* hash chain */
+} dyn_pair;
+
+typedef struct _dyn_pool {
+    dyn_pair* pairs;
+    int* buckets;
+    int nbuckets;
+    int max_pairs;
+    int top;
+    int head;
+    int tail;
+    /* tells pins taken on this pool from ones taken before start_color set
+     * it up again (or after the screen was closed, when it is 0) */
+    unsigned long generation;
+} dyn_pool;
+
+/* the state kept for each terminal. the lua side of it (the colors and
+ * color_pairs tables) lives in the registry while the screen is current,
+ * and in the screen's environment table otherwise */
+typedef struct _screen {
+    SCREEN* sp; /* NULL for the terminal opened by initscr */
+    FILE* ofp;
+    FILE* ifp;
+    int out_fd; /* the real output, when ofp goes to an output proxy */
+    /* set when output is counted, or sent asynchronously (see newterm) */
+    term_output* output;
+    int input_fd;
+
+    int ncolor_pairs;
+    int default_color_available;
+    int raw_keycodes;
+
+    dyn_pool dyn;
+
+    int frame_deferred;
+    unsigned long frames_coalesced;
+    /* the minimum time between updates, from setup_term's max_fps */
+    double update_interval;
+    double last_update;
+    /* how long getch waits for more resizes after one, in milliseconds, from
+     * setup_term's resize_delay */
+    int resize_delay;
+
+    /* rgb colors (see define_rgb_color): the next color to give out, which
+     * colors have been given out, and the table for mapping to the rest */
+    int next_rgb_color;
+    int nredefined;
+    unsigned char redefined[256];
+    unsigned short* rgb_lut;
+    int rgb_lut_colors; /* the palette size the table was filled for, or 0 */
+} screen;
+
+/* call counts and timings for a function, while profiling */
+typedef struct _profile_entry {
+    unsigned long calls;
+    double time;
+    double blocked;
+} profile_entry;
+
+static int key_names_ref = LUA_NOREF;
+/* whether profiling is on, and the total time spent blocked in ncurses so
+ * far, waiting for input or for output to be written (see profile) */
+static int profiling = 0;
+static double blocked_time = 0;
+/* the terminal everything currently applies to. this starts out as the one
+ * initscr opens, and is switched by newterm and set_term */
+static screen initscr_screen;
+static screen* cur_screen = &initscr_screen;
+
+/* pushes the table holding the current screen's colors and color_pairs */
+static void push_screen_state(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    lua_getfield(L, -1, "screen_state");
+    lua_remove(L, -2);
+}
 
 static int get_color_pair(lua_State* L, const char* str)
 {
     int ret = -1;
 
-    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    push_screen_state(L);
     lua_getfield(L, -1, "color_pairs");
-    lua_pushnil(L);
-    while (lua_next(L, -2) != 0) {
-        if (lua_isstring(L, -2)) {
-            const char* key;
+    lua_getfield(L, -1, str);
+    if (lua_isnumber(L, -1)) {
+        ret = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 3);
 
-            key = lua_tostring(L, -2);
-            if (!strcmp(key, str)) {
-                ret = lua_tointeger(L, -1);
-                lua_pop(L, 2);
-                break;
+    return ret;
+}
+
+static void init_dyn_pairs(dyn_pool* dp)
+{
+    static unsigned long generation = 0;
+    int i;
+
+    free(dp->pairs);
+    free(dp->buckets);
+
+    /* pairs are stored in the A_COLOR bits of a chtype, so that caps how
+     * many we can actually use */
+    dp->max_pairs = COLOR_PAIRS;
+    if (dp->max_pairs > PAIR_NUMBER(A_COLOR) + 1) {
+        dp->max_pairs = PAIR_NUMBER(A_COLOR) + 1;
+    }
+    for (dp->nbuckets = 1; dp->nbuckets < dp->max_pairs; dp->nbuckets <<= 1);
+
+    dp->pairs = calloc(dp->max_pairs, sizeof(dyn_pair));
+    dp->buckets = malloc(dp->nbuckets * sizeof(int));
+    for (i = 0; i < dp->nbuckets; ++i) {
+        dp->buckets[i] = -1;
+    }
+    dp->top = dp->max_pairs - 1;
+    dp->head = dp->tail = -1;
+    dp->generation = ++generation;
+}
+
+static void free_dyn_pairs(dyn_pool* dp)
+{
+    free(dp->pairs);
+    free(dp->buckets);
+    dp->pairs = NULL;
+    dp->buckets = NULL;
+    dp->generation = 0;
+}
+
+static int dyn_hash(dyn_pool* dp, int fg, int bg)
+{
+    return (((unsigned)fg * 2654435761u) ^ (unsigned)bg) & (dp->nbuckets - 1);
+}
+
+static void dyn_link(dyn_pool* dp, int pair)
+{
+    dp->pairs[pair].prev = -1;
+    dp->pairs[pair].next = dp->head;
+    if (dp->head != -1) {
+        dp->pairs[dp->head].prev = pair;
+    }
+    dp->head = pair;
+    if (dp->tail == -1) {
+        dp->tail = pair;
+    }
+}
+
+static void dyn_unlink(dyn_pool* dp, int pair)
+{
+    dyn_pair* p = &dp->pairs[pair];
+
+    if (p->prev != -1) {
+        dp->pairs[p->prev].next = p->next;
+    }
+    else {
+        dp->head = p->next;
+    }
+    if (p->next != -1) {
+        dp->pairs[p->next].prev = p->prev;
+    }
+    else {
+        dp->tail = p->prev;
+    }
+}
+
+static void dyn_unhash(dyn_pool* dp, int pair)
+{
+    int* link;
+
+    link = &dp->buckets[dyn_hash(dp, dp->pairs[pair].fg, dp->pairs[pair].bg)];
+    while (*link != pair) {
+        link = &dp->pairs[*link].hnext;
+    }
+    *link = dp->pairs[pair].hnext;
+}
+
+/* take a pair out of the dynamic pool, for instance because init_pair wants
+ * to give it a name */
+static void release_dyn_pair(dyn_pool* dp, int pair)
+{
+    if (pair > 0 && pair < dp->max_pairs && dp->pairs[pair].in_use) {
+        dyn_unhash(dp, pair);
+        if (dp->pairs[pair].pins == 0) {
+            dyn_unlink(dp, pair);
+        }
+        dp->pairs[pair].in_use = 0;
+        dp->pairs[pair].pins = 0;
+    }
+}
+
+static int dyn_pair_pinned(dyn_pool* dp, int pair)
+{
+    return pair > 0 && pair < dp->max_pairs && dp->pairs[pair].in_use &&
+           dp->pairs[pair].pins > 0;
+}
+
+/* keeps the dynamic pair (if it is one) from being evicted until it is
+ * unpinned as many times as it was pinned. returns whether it was pinned */
+static int pin_dyn_pair(dyn_pool* dp, int pair)
+{
+    if (pair <= 0 || pair >= dp->max_pairs || !dp->pairs[pair].in_use) {
+        return 0;
+    }
+
+    if (dp->pairs[pair].pins++ == 0) {
+        dyn_unlink(dp, pair);
+    }
+    return 1;
+}
+
+/* once the last pin is dropped, the pair goes back on the LRU list, as the
+ * most recently used */
+static int unpin_dyn_pair(dyn_pool* dp, int pair)
+{
+    if (!dyn_pair_pinned(dp, pair)) {
+        return 0;
+    }
+
+    if (--dp->pairs[pair].pins == 0) {
+        dyn_link(dp, pair);
+    }
+    return 1;
+}
+
+/* named pairs are allocated up to min_pair */
+static int alloc_dyn_pair(dyn_pool* dp, int min_pair, int fg, int bg)
+{
+    int pair, bucket;
+
+    if (dp->pairs == NULL) {
+        return -1;
+    }
+
+    bucket = dyn_hash(dp, fg, bg);
+    for (pair = dp->buckets[bucket]; pair != -1;
+         pair = dp->pairs[pair].hnext) {
+        if (dp->pairs[pair].fg == fg && dp->pairs[pair].bg == bg) {
+            if (dp->pairs[pair].pins == 0 && pair != dp->head) {
+                dyn_unlink(dp, pair);
+                dyn_link(dp, pair);
             }
+            return pair;
+        }
+    }
+
+    if (dp->top > min_pair) {
+        pair = dp->top--;
+    }
+    else if (dp->tail != -1) {
+        pair = dp->tail;
+        release_dyn_pair(dp, pair);
+    }
+    else {
+        return -1;
+    }
+
+    if (init_pair(pair, fg, bg) != OK) {
+        return -1;
+    }
+
+    dp->pairs[pair].fg = fg;
+    dp->pairs[pair].bg = bg;
+    dp->pairs[pair].in_use = 1;
+    dp->pairs[pair].hnext = dp->buckets[bucket];
+    dp->buckets[bucket] = pair;
+    dyn_link(dp, pair);
+
+    return pair;
+}
+
+/* rgb colors. on terminals which can redefine their colors, each rgb color
+ * is given a color of its own, from the colors after the 16 ansi ones, for
+ * as long as there are any left. otherwise (and once they run out) it is
+ * mapped to the nearest color which hasn't been redefined, taking the
+ * palette to be xterm's. that goes through a table covering the rgb cube in
+ * 32x32x32 cells, each of which is filled in the first time it's needed (and
+ * again once more colors have been redefined), so mapping a color is mostly
+ * a single lookup, without ever stopping to search for all of them at once */
+#define RGB_LUT_BITS 5
+#define RGB_LUT_SIZE (1 << (3 * RGB_LUT_BITS))
+#define RGB_LUT_EMPTY 0xffff
+
+static const unsigned char xterm_colors[16][3] = {
+    {  0,   0,   0}, {205,   0,   0}, {  0, 205,   0}, {205, 205,   0},
+    {  0,   0, 238}, {205,   0, 205}, {  0, 205, 205}, {229, 229, 229},
+    {127, 127, 127}, {255,   0,   0}, {  0, 255,   0}, {255, 255,   0},
+    { 92,  92, 255}, {255,   0, 255}, {  0, 255, 255}, {255, 255, 255},
+};
+static const unsigned char xterm_cube_levels[6] = {0, 95, 135, 175, 215, 255};
+
+static int rgb_dist(int r1, int g1, int b1, int r2, int g2, int b2)
+{
+    return (r1 - r2) * (r1 - r2) + (g1 - g2) * (g1 - g2) +
+           (b1 - b2) * (b1 - b2);
+}
+
+/* the stock value of a color in xterm's 256 color palette */
+static void xterm_rgb(int color, int* rgb)
+{
+    int i;
+
+    if (color < 16) {
+        for (i = 0; i < 3; ++i) {
+            rgb[i] = xterm_colors[color][i];
+        }
+    }
+    else if (color < 232) {
+        color -= 16;
+        rgb[0] = xterm_cube_levels[color / 36];
+        rgb[1] = xterm_cube_levels[color / 6 % 6];
+        rgb[2] = xterm_cube_levels[color % 6];
+    }
+    else {
+        rgb[0] = rgb[1] = rgb[2] = 8 + 10 * (color - 232);
+    }
+}
+
+static int nearest_cube_level(int v)
+{
+    int i;
+
+    for (i = 0; i < 5 &&
+         v > (xterm_cube_levels[i] + xterm_cube_levels[i + 1]) / 2; ++i);
+
+    return i;
+}
+
+/* the nearest color in the colors from first up to (but not including)
+ * last which haven't been redefined, or -1 if there aren't any */
+static int search_colors(screen* scr, int r, int g, int b, int first,
+                         int last)
+{
+    int i, best = -1, best_dist = INT_MAX;
+
+    for (i = first; i < last; ++i) {
+        int rgb[3], dist;
+
+        if (scr->redefined[i]) {
+            continue;
+        }
+        xterm_rgb(i, rgb);
+        dist = rgb_dist(r, g, b, rgb[0], rgb[1], rgb[2]);
+        if (dist < best_dist) {
+            best = i;
+            best_dist = dist;
+        }
+    }
+
+    return best;
+}
+
+/* the search the table is built with. 256 color palettes are matched
+ * against the color cube and the gray ramp, and only fall back to the first
+ * 16 colors (which terminals so often change) once those have all been
+ * redefined. smaller palettes only use the first 16 */
+static int search_palette(screen* scr, int r, int g, int b, int ncolors)
+{
+    int best;
+
+    if (ncolors >= 256 && scr->nredefined == 0) {
+        int cr, cg, cb, i, gray;
+
+        /* with the palette untouched, the nearest cube color and the
+         * nearest step of the gray ramp can be worked out directly */
+        cr = nearest_cube_level(r);
+        cg = nearest_cube_level(g);
+        cb = nearest_cube_level(b);
+        best = 16 + 36 * cr + 6 * cg + cb;
+
+        /* the ramp runs from 8 to 238 in steps of 10 */
+        i = ((r + g + b) / 3 - 3) / 10;
+        if (i < 0) {
+            i = 0;
+        }
+        else if (i > 23) {
+            i = 23;
+        }
+        gray = 8 + 10 * i;
+        if (rgb_dist(r, g, b, gray, gray, gray) <
+            rgb_dist(r, g, b, xterm_cube_levels[cr], xterm_cube_levels[cg],
+                     xterm_cube_levels[cb])) {
+            best = 232 + i;
+        }
+
+        return best;
+    }
+
+    best = -1;
+    if (ncolors >= 256) {
+        best = search_colors(scr, r, g, b, 16, 256);
+    }
+    if (best < 0) {
+        best = search_colors(scr, r, g, b, 0, ncolors < 16 ? ncolors : 16);
+    }
+
+    return best < 0 ? 0 : best;
+}
+
+static int nearest_color(int r, int g, int b)
+{
+    const int shift = 8 - RGB_LUT_BITS;
+    screen* scr = cur_screen;
+
+    int cell;
+
+    if (scr->rgb_lut == NULL) {
+        scr->rgb_lut = malloc(RGB_LUT_SIZE * sizeof(unsigned short));
+        if (scr->rgb_lut == NULL) {
+            return search_palette(scr, r, g, b, COLORS);
+        }
+        scr->rgb_lut_colors = 0;
+    }
+
+    if (scr->rgb_lut_colors != COLORS) {
+        memset(scr->rgb_lut, 0xff, RGB_LUT_SIZE * sizeof(unsigned short));
+        scr->rgb_lut_colors = COLORS;
+    }
+
+    /* each cell maps to the color nearest its center */
+    cell = ((r >> shift) << (2 * RGB_LUT_BITS)) |
+           ((g >> shift) << RGB_LUT_BITS) | (b >> shift);
+    if (scr->rgb_lut[cell] == RGB_LUT_EMPTY) {
+        scr->rgb_lut[cell] = search_palette(scr,
+                                            (r & ~((1 << shift) - 1)) |
+                                            (1 << (shift - 1)),
+                                            (g & ~((1 << shift) - 1)) |
+                                            (1 << (shift - 1)),
+                                            (b & ~((1 << shift) - 1)) |
+                                            (1 << (shift - 1)),
+                                            COLORS);
+    }
+
+    return scr->rgb_lut[cell];
+}
+
+/* parses "#rrggbb" or "#rgb" into components from 0 to 255 */
+static int parse_rgb(const char* str, int* rgb)
+{
+    int len, i, digits[6];
+
+    len = strlen(str);
+    if (str[0] != '#' || (len != 4 && len != 7)) {
+        return 0;
+    }
+
+    for (i = 1; i < len; ++i) {
+        char c = str[i];
+
+        if (c >= '0' && c <= '9') {
+            digits[i - 1] = c - '0';
+        }
+        else if (c >= 'a' && c <= 'f') {
+            digits[i - 1] = c - 'a' + 10;
+        }
+        else if (c >= 'A' && c <= 'F') {
+            digits[i - 1] = c - 'A' + 10;
+        }
+        else {
+            return 0;
+        }
+    }
+
+    for (i = 0; i < 3; ++i) {
+        if (len == 4) {
+            rgb[i] = digits[i] * 17;
         }
+        else {
+            rgb[i] = digits[2 * i] * 16 + digits[2 * i + 1];
+        }
+    }
+
+    return 1;
+}
+
+static int set_rgb_color(int color, int r, int g, int b)
+{
+    /* color values are given to ncurses in thousandths */
+    return init_color(color, r * 1000 / 255, g * 1000 / 255,
+                      b * 1000 / 255) == OK;
+}
+
+/* gives the name a color which looks like r, g, b (see above), and returns
+ * it. a name which already has a color of its own has it redefined, but
+ * names which were mapped to a color in the palette never change it, since
+ * other names may be sharing it */
+static int define_rgb_color(lua_State* L, const char* name, int r, int g,
+                            int b)
+{
+    screen* scr = cur_screen;
+    int color = -1;
+
+    push_screen_state(L);
+    lua_getfield(L, -1, "rgb_colors");
+    if (lua_isnil(L, -1)) {
         lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, "rgb_colors");
+    }
+
+    lua_getfield(L, -1, name);
+    if (lua_isnumber(L, -1)) {
+        /* redefining its own color */
+        color = lua_tointeger(L, -1);
+        if (!set_rgb_color(color, r, g, b)) {
+            color = -1;
+        }
+    }
+    else if (can_change_color()) {
+        int last = COLORS < 256 ? COLORS : 256;
+
+        if (scr->next_rgb_color < 16) {
+            scr->next_rgb_color = 16;
+        }
+        /* the color is only taken once it has actually been set up */
+        if (scr->next_rgb_color < last &&
+            set_rgb_color(scr->next_rgb_color, r, g, b)) {
+            color = scr->next_rgb_color++;
+            scr->redefined[color] = 1;
+            scr->nredefined++;
+            scr->rgb_lut_colors = 0;
+
+            lua_pushinteger(L, color);
+            lua_setfield(L, -3, name);
+        }
+    }
+    lua_pop(L, 2);
+
+    if (color < 0) {
+        color = nearest_color(r, g, b);
     }
+
+    lua_getfield(L, -1, "colors");
+    lua_pushinteger(L, color);
+    lua_setfield(L, -2, name);
     lua_pop(L, 2);
 
+    return color;
+}
+
+/* looks a color up by name. rgb names ("#rrggbb" or "#rgb") are defined the
+ * first time they are used */
+static int lookup_color(lua_State* L, const char* name, int* color)
+{
+    int rgb[3];
+
+    push_screen_state(L);
+    lua_getfield(L, -1, "colors");
+    lua_getfield(L, -1, name);
+    if (!lua_isnil(L, -1)) {
+        *color = lua_tointeger(L, -1);
+        lua_pop(L, 3);
+        return 1;
+    }
+    lua_pop(L, 3);
+
+    if (!parse_rgb(name, rgb)) {
+        return 0;
+    }
+    *color = define_rgb_color(L, name, rgb[0], rgb[1], rgb[2]);
+
+    return 1;
+}
+
+/* colors can be given either by name or as a raw color number */
+static int get_color_val(lua_State* L, int stack_pos)
+{
+    int ret;
+    const char* name;
+
+    if (lua_type(L, stack_pos) == LUA_TNUMBER) {
+        return lua_tointeger(L, stack_pos);
+    }
+
+    name = luaL_checklstring(L, stack_pos, NULL);
+    if (!lookup_color(L, name, &ret)) {
+        return luaL_error(L, "Unknown color \"%s\"", name);
+    }
+
     return ret;
 }
 
 static void init_color_pairs(lua_State* L)
 {
-    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    push_screen_state(L);
     lua_newtable(L);
     lua_pushinteger(L, 0);
     lua_setfield(L, -2, "default");
@@ -60,49 +701,96 @@ static void register_color(const char* color_str, int color_tag, void* data)
 {
     lua_pushinteger((lua_State*)data, color_tag);
     lua_setfield((lua_State*)data, -2, color_str);
-    ncolors++;
 }
 
 static void register_default_color(lua_State* L)
 {
-    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    push_screen_state(L);
     lua_getfield(L, -1, "colors");
     lua_pushinteger(L, -1);
     lua_setfield(L, -2, "default");
     lua_pop(L, 2);
-    default_color_available = 1;
+    cur_screen->default_color_available = 1;
 }
 
 static void init_colors(lua_State* L)
 {
-    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    push_screen_state(L);
     lua_newtable(L);
     each_color(register_color, L);
     lua_setfield(L, -2, "colors");
+    lua_pushnil(L);
+    lua_setfield(L, -2, "rgb_colors");
     lua_pop(L, 1);
 }
 
-static int get_pos(lua_State* L, pos* p)
+static window* to_window(lua_State* L, int stack_pos)
+{
+    window* w;
+    int is_window;
+
+    w = lua_touserdata(L, stack_pos);
+    if (w == NULL || !lua_getmetatable(L, stack_pos)) {
+        return NULL;
+    }
+    luaL_getmetatable(L, WINDOW_TABLE);
+    is_window = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+
+    return is_window ? w : NULL;
+}
+
+static window* check_window(lua_State* L, int stack_pos)
+{
+    window* w;
+
+    w = (window*)luaL_checkudata(L, stack_pos, WINDOW_TABLE);
+    if (w->win == NULL) {
+        luaL_error(L, "Attempt to use a deleted window");
+    }
+
+    return w;
+}
+
+/* if the argument at *stack_pos is a window, return it and move past it,
+ * otherwise we want stdscr */
+static WINDOW* get_window(lua_State* L, int* stack_pos)
+{
+    window* w;
+
+    w = to_window(L, *stack_pos);
+    if (w == NULL) {
+        return stdscr;
+    }
+    if (w->win == NULL) {
+        luaL_error(L, "Attempt to use a deleted window");
+    }
+
+    (*stack_pos)++;
+    return w->win;
+}
+
+static int get_pos(lua_State* L, WINDOW* win, int* stack_pos, pos* p)
 {
-    if (!lua_istable(L, 1)) {
+    if (!lua_istable(L, *stack_pos)) {
         return 0;
     }
 
-    getyx(stdscr, p->y, p->x);
+    getyx(win, p->y, p->x);
 
-    lua_getfield(L, 1, "x");
+    lua_getfield(L, *stack_pos, "x");
     if (lua_isnumber(L, -1)) {
         p->x = lua_tonumber(L, -1);
     }
     lua_pop(L, 1);
 
-    lua_getfield(L, 1, "y");
+    lua_getfield(L, *stack_pos, "y");
     if (lua_isnumber(L, -1)) {
         p->y = lua_tonumber(L, -1);
     }
     lua_pop(L, 1);
 
-    lua_remove(L, 1);
+    (*stack_pos)++;
 
     return 1;
 }
@@ -114,6 +802,7 @@ static int get_char_color(lua_State* L, int stack_pos)
 
     lua_getfield(L, stack_pos, "color");
     if (!lua_isstring(L, -1)) {
+        lua_pop(L, 1);
         return 0;
     }
     str = lua_tostring(L, -1);
@@ -128,9 +817,14 @@ static int get_char_color(lua_State* L, int stack_pos)
 
 static int get_char_attr(lua_State* L, int stack_pos)
 {
-    int mode = A_NORMAL;
+    int mode = A_NORMAL, fg = -1, bg = -1, dyn_color = 0;
 
-    lua_pushnil(L);
+    if (!cur_screen->default_color_available) {
+        fg = COLOR_WHITE;
+        bg = COLOR_BLACK;
+    }
+
+    lua_pushnil(L);
     while (lua_next(L, stack_pos) != 0) {
         if (lua_isstring(L, -2)) {
             const char* str;
@@ -139,6 +833,14 @@ static int get_char_attr(lua_State* L, int stack_pos)
             if (!strcmp(str, "color")) {
                 mode |= get_char_color(L, stack_pos);
             }
+            else if (!strcmp(str, "fg")) {
+                fg = get_color_val(L, lua_gettop(L));
+                dyn_color = 1;
+            }
+            else if (!strcmp(str, "bg")) {
+                bg = get_color_val(L, lua_gettop(L));
+                dyn_color = 1;
+            }
             else {
                 int cur_mode;
 
@@ -153,530 +855,4044 @@ static int get_char_attr(lua_State* L, int stack_pos)
         lua_pop(L, 1);
     }
 
+    if (dyn_color) {
+        int pair;
+
+        pair = alloc_dyn_pair(&cur_screen->dyn, cur_screen->ncolor_pairs,
+                              fg, bg);
+        if (pair == -1) {
+            return luaL_error(L, "Unable to allocate a color pair");
+        }
+        mode = (mode & ~A_COLOR) | COLOR_PAIR(pair);
+    }
+
     return mode;
 }
 
-NO_ARG_FUNCTION(initscr)
-NO_ARG_FUNCTION(endwin)
-NO_ARG_FUNCTION(erase)
-NO_ARG_FUNCTION(clear)
-NO_ARG_FUNCTION(clrtobot)
-NO_ARG_FUNCTION(clrtoeol)
-NO_ARG_FUNCTION(deleteln)
-NO_ARG_FUNCTION(insertln)
-NO_ARG_FUNCTION(refresh)
-NO_ARG_FUNCTION(beep)
-NO_ARG_FUNCTION(flash)
+/* styles are attribute tables which have already been resolved into the
+ * chtype attributes they describe, so they can be passed around as plain
+ * numbers */
+#define is_style(L, stack_pos) \
+    (lua_istable(L, stack_pos) || lua_type(L, stack_pos) == LUA_TNUMBER)
 
-static int l_isendwin(lua_State* L)
+static chtype get_style(lua_State* L, int stack_pos)
 {
-    lua_pushboolean(L, isendwin());
-    return 1;
+    if (lua_type(L, stack_pos) == LUA_TNUMBER) {
+        return (chtype)lua_tonumber(L, stack_pos);
+    }
+    else if (lua_istable(L, stack_pos)) {
+        return get_char_attr(L, stack_pos);
+    }
+
+    return A_NORMAL;
 }
 
-static int l_start_color(lua_State* L)
+/* wide character support. strings are treated as utf-8, but text which is
+ * entirely ascii (which is most of it) is passed straight through to the
+ * narrow functions without being decoded */
+static wchar_t* wide_buf = NULL;
+static size_t wide_buf_size = 0;
+
+/* wcwidth results for the BMP, stored as width + 2 so that 0 can mean that we
+ * haven't looked it up yet */
+static signed char wcwidth_cache[0x10000];
+
+static int is_ascii(const char* str, size_t len)
 {
-    if (has_colors()) {
-        init_color_pairs(L);
-        init_colors(L);
-        lua_pushboolean(L, start_color() == OK);
+    unsigned long word, high_bits;
+    size_t i = 0;
+
+    high_bits = ((unsigned long)-1 / 0xff) * 0x80;
+    for (; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, str + i, sizeof(word));
+        if (word & high_bits) {
+            return 0;
+        }
     }
-    else {
-        lua_pushboolean(L, FALSE);
+    for (; i < len; ++i) {
+        if ((unsigned char)str[i] & 0x80) {
+            return 0;
+        }
     }
 
     return 1;
 }
 
-static int l_use_default_colors(lua_State* L)
+/* decode a single utf-8 sequence, returning the number of bytes used.
+ * invalid sequences decode to U+FFFD one byte at a time */
+static size_t decode_utf8(const unsigned char* str, size_t len, wchar_t* wc)
 {
-    register_default_color(L);
-    lua_pushboolean(L, use_default_colors() == OK);
-    return 1;
+    unsigned long cp;
+    size_t n, i;
+
+    if (str[0] < 0x80) {
+        *wc = str[0];
+        return 1;
+    }
+    else if (str[0] >= 0xc2 && str[0] <= 0xdf) {
+        n = 2;
+        cp = str[0] & 0x1f;
+    }
+    else if (str[0] >= 0xe0 && str[0] <= 0xef) {
+        n = 3;
+        cp = str[0] & 0x0f;
+    }
+    else if (str[0] >= 0xf0 && str[0] <= 0xf4) {
+        n = 4;
+        cp = str[0] & 0x07;
+    }
+    else {
+        *wc = 0xfffd;
+        return 1;
+    }
+
+    if (n > len) {
+        *wc = 0xfffd;
+        return 1;
+    }
+    for (i = 1; i < n; ++i) {
+        if ((str[i] & 0xc0) != 0x80) {
+            *wc = 0xfffd;
+            return 1;
+        }
+        cp = (cp << 6) | (str[i] & 0x3f);
+    }
+    if ((n == 3 && cp < 0x800) || (cp >= 0xd800 && cp <= 0xdfff) ||
+        (n == 4 && (cp < 0x10000 || cp > 0x10ffff))) {
+        *wc = 0xfffd;
+        return 1;
+    }
+
+    *wc = cp;
+    return n;
 }
 
-static int l_assume_default_colors(lua_State* L)
+/* decode a whole string into a buffer which is reused between calls */
+static wchar_t* decode_utf8_str(const char* str, size_t len, int* wlen)
 {
-    const char* fg;
-    const char* bg;
-    int nfg, nbg;
+    size_t i = 0;
+    int n = 0;
 
-    register_default_color(L);
+    if (wide_buf_size < len + 1) {
+        wchar_t* buf;
 
-    fg = luaL_optlstring(L, 1, "default", NULL);
-    bg = luaL_optlstring(L, 2, "default", NULL);
+        buf = realloc(wide_buf, (len + 1) * sizeof(wchar_t));
+        if (buf == NULL) {
+            return NULL;
+        }
+        wide_buf = buf;
+        wide_buf_size = len + 1;
+    }
 
-    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
-    lua_getfield(L, -1, "colors");
-    lua_getfield(L, -1, fg);
-    nfg = luaL_checkint(L, -1);
-    lua_pop(L, 1);
+    while (i < len) {
+        i += decode_utf8((const unsigned char*)str + i, len - i,
+                         &wide_buf[n++]);
+    }
+    wide_buf[n] = L'\0';
 
-    lua_getfield(L, -1, bg);
-    nbg = luaL_checkint(L, -1);
-    lua_pop(L, 3);
+    *wlen = n;
+    return wide_buf;
+}
 
-    lua_pushboolean(L, assume_default_colors(nfg, nbg) == OK);
-    return 1;
+static int char_width(wchar_t wc)
+{
+    if (wc >= 0x20 && wc < 0x7f) {
+        return 1;
+    }
+    if (wc < 0x10000) {
+        int w;
+
+        if (wcwidth_cache[wc] != 0) {
+            return wcwidth_cache[wc] - 2;
+        }
+        /* characters the locale doesn't know about aren't cached, since
+         * they are what everything looks like until it has been set */
+        w = wcwidth(wc);
+        if (w >= 0) {
+            wcwidth_cache[wc] = w + 2;
+        }
+        return w;
+    }
+
+    return wcwidth(wc);
 }
 
-static int l_setup_term(lua_State* L)
+/* the number of columns a utf-8 string takes up on the screen */
+static int str_width(const char* str, size_t len)
 {
-    int ret = 0;
+    size_t i = 0;
+    int width = 0;
 
-    luaL_checktype(L, 1, LUA_TTABLE);
+    if (is_ascii(str, len)) {
+        return len;
+    }
 
-    lua_pushnil(L);
-    while (lua_next(L, 1) != 0) {
-        if (lua_isstring(L, -2)) {
-            const char* str;
+    while (i < len) {
+        wchar_t wc;
+        int w;
 
-            str = lua_tostring(L, -2);
-            if (!strcmp(str, "cbreak")) {
-                ret += ((lua_toboolean(L, -1) ? cbreak() : nocbreak()) == OK);
-            }
-            else if (!strcmp(str, "echo")) {
-                ret += ((lua_toboolean(L, -1) ? echo() : noecho()) == OK);
-            }
-            else if (!strcmp(str, "halfdelay")) {
-                ret += (halfdelay(lua_tointeger(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "intrflush")) {
-                ret += (intrflush(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "keypad")) {
-                ret += (keypad(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "meta")) {
-                ret += (meta(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "nodelay")) {
-                ret += (nodelay(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "raw")) {
-                ret += ((lua_toboolean(L, -1) ? raw() : noraw()) == OK);
-            }
-            else if (!strcmp(str, "qiflush")) {
-                lua_toboolean(L, -1) ? qiflush() : noqiflush();
-                ret++;
-            }
-            else if (!strcmp(str, "timeout")) {
-                if (lua_isnil(L, -1)) {
-                    ret += (notimeout(stdscr, TRUE) == OK);
-                }
-                else {
-                    timeout(lua_tointeger(L, -1));
-                    ret++;
-                }
-            }
-            else if (!strcmp(str, "typeahead")) {
-                ret += ((lua_toboolean(L, -1) ? typeahead(0) :
-                                                typeahead(-1)) == OK);
-            }
-            else if (!strcmp(str, "clear")) {
-                ret += (clearok(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "idl")) {
-                ret += (idlok(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "idc")) {
-                idcok(stdscr, lua_toboolean(L, -1));
-                ret++;
-            }
-            else if (!strcmp(str, "immed")) {
-                immedok(stdscr, lua_toboolean(L, -1));
-                ret++;
-            }
-            else if (!strcmp(str, "leave")) {
-                ret += (leaveok(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "scroll")) {
-                ret += (scrollok(stdscr, lua_toboolean(L, -1)) == OK);
-            }
-            else if (!strcmp(str, "nl")) {
-                ret += ((lua_toboolean(L, -1) ? nl() : nonl()) == OK);
-            }
-            else {
-                luaL_error(L, "Unknown or unimplemented terminal mode %s", str);
-            }
+        i += decode_utf8((const unsigned char*)str + i, len - i, &wc);
+        w = char_width(wc);
+        if (w > 0) {
+            width += w;
         }
-        lua_pop(L, 1);
     }
 
-    lua_pushnumber(L, ret);
-    return 1;
+    return width;
 }
 
-static int l_init_color(lua_State* L)
+/* the number of bytes in the utf-8 character at str, and the number of
+ * columns it takes up */
+static size_t measure_char(const char* str, size_t len, int* width)
 {
-    const char* name;
-    int color_val;
-    short r, g, b;
+    wchar_t wc;
+    size_t n;
 
-    if (can_change_color() == FALSE) {
-        lua_pushboolean(L, FALSE);
-        return 1;
+    n = decode_utf8((const unsigned char*)str, len, &wc);
+    *width = char_width(wc);
+    if (*width < 0) {
+        *width = 0;
     }
 
-    name = luaL_checklstring(L, 1, NULL);
+    return n;
+}
 
-    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
-    lua_getfield(L, -1, "colors");
-    lua_getfield(L, -1, name);
-    if (lua_isnil(L, -1)) {
-        lua_pop(L, 1);
-        lua_pushinteger(L, ++ncolors);
-        lua_pushvalue(L, -1);
-        lua_setfield(L, -3, name);
+/* a single non-ascii character, along with its attributes */
+static int get_wide_char(cchar_t* cc, const char* str, size_t len,
+                         chtype style)
+{
+    wchar_t wc[2];
+
+    decode_utf8((const unsigned char*)str, len, &wc[0]);
+    wc[1] = L'\0';
+
+    return setcchar(cc, wc, style & A_ATTRIBUTES & ~A_COLOR,
+                    PAIR_NUMBER(style), NULL);
+}
+
+NO_ARG_FUNCTION(beep)
+NO_ARG_FUNCTION(flash)
+
+WINDOW_FUNCTION(erase)
+WINDOW_FUNCTION(clear)
+WINDOW_FUNCTION(clrtobot)
+WINDOW_FUNCTION(clrtoeol)
+WINDOW_FUNCTION(deleteln)
+WINDOW_FUNCTION(insertln)
+
+/* when output goes through an instrumented stream, the terminal modes which
+ * ncurses sets on it have to be copied over to the real terminal */
+static void sync_modes(void)
+{
+    if (cur_screen->output != NULL) {
+        output_sync_modes(cur_screen->output, !isendwin());
     }
-    color_val = lua_tointeger(L, -1);
-    lua_pop(L, 2);
+}
 
-    if (lua_istable(L, 2)) {
-        lua_getfield(L, 2, "r");
-        lua_getfield(L, 2, "g");
-        lua_getfield(L, 2, "b");
-        r = luaL_checkint(L, -3) * 1000 / 256;
-        g = luaL_checkint(L, -2) * 1000 / 256;
-        b = luaL_checkint(L, -1) * 1000 / 256;
-        lua_pop(L, 3);
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* calls which can block are bracketed by these, so that the time spent in
+ * them can be told apart from our own work when profiling */
+static double begin_blocking(void)
+{
+    return profiling ? now() : 0;
+}
+
+static void end_blocking(double start)
+{
+    if (profiling) {
+        blocked_time += now() - start;
     }
-    else {
-        r = luaL_checkint(L, 2) * 1000 / 256;
-        g = luaL_checkint(L, 3) * 1000 / 256;
-        b = luaL_checkint(L, 4) * 1000 / 256;
+}
+
+/* writes the virtual screen out to the terminal, counting the bytes it
+ * takes against the update */
+static int do_update(void)
+{
+    int ret;
+    double blocked;
+
+    cur_screen->frame_deferred = 0;
+    if (cur_screen->update_interval > 0) {
+        cur_screen->last_update = now();
+    }
+    blocked = begin_blocking();
+    if (cur_screen->output == NULL) {
+        ret = doupdate();
+        end_blocking(blocked);
+        return ret;
     }
 
-    lua_pushboolean(L, init_color(color_val, r, g, b) == OK);
+    output_begin_refresh(cur_screen->output);
+    ret = doupdate();
+    output_end_refresh(cur_screen->output);
+    end_blocking(blocked);
+    sync_modes();
 
-    return 1;
+    return ret;
 }
 
-static int l_init_pair(lua_State* L)
+/* the update is put off until the next one (or until flush or getch) if it
+ * comes too soon after the last one when the frame rate is limited, or, in
+ * async mode, if the last frame is still on its way to the terminal. the
+ * frames in between are merged rather than being sent one by one */
+static int update_screen(void)
 {
-    const char *name, *fg, *bg;
-    int name_val, fg_val, bg_val;
+    screen* scr = cur_screen;
 
-    /* check the arguments, and get them */
-    name = luaL_checklstring(L, 1, NULL);
-    if (default_color_available) {
-        fg =   luaL_optlstring(L, 2, "default", NULL);
-        bg =   luaL_optlstring(L, 3, "default", NULL);
+    if ((scr->update_interval > 0 &&
+         now() - scr->last_update < scr->update_interval) ||
+        (scr->output != NULL && output_is_async(scr->output) &&
+         output_busy(scr->output))) {
+        scr->frame_deferred = 1;
+        scr->frames_coalesced++;
+        return OK;
     }
-    else {
-        fg =   luaL_optlstring(L, 2, "white", NULL);
-        bg =   luaL_optlstring(L, 3, "black", NULL);
+
+    return do_update();
+}
+
+static void flush_deferred(void)
+{
+    if (cur_screen->frame_deferred) {
+        do_update();
+    }
+}
+
+/* a deferred update has to go out before getch waits for input, but when it
+ * won't wait, the frame rate limit still applies */
+static void flush_before_input(WINDOW* win)
+{
+    if (cur_screen->frame_deferred) {
+        if (wgetdelay(win) == 0) {
+            update_screen();
+        }
+        else {
+            do_update();
+        }
     }
+}
+
+static void init_locale(void)
+{
+    /* ncurses needs the locale to be set to be able to output anything
+     * outside of ascii, but don't override one the program set itself */
+    if (!strcmp(setlocale(LC_CTYPE, NULL), "C")) {
+        setlocale(LC_CTYPE, "");
+        /* widths depend on the locale */
+        memset(wcwidth_cache, 0, sizeof(wcwidth_cache));
+    }
+}
+
+/* an argument to newterm naming a file, either by descriptor or path. this
+ * doesn't raise errors (the arguments are checked beforehand), so that a
+ * descriptor which was already opened for the other argument can be closed.
+ * returns -1 if the file couldn't be opened */
+static int get_term_fd(lua_State* L, int stack_pos, int def)
+{
+    if (lua_isnoneornil(L, stack_pos)) {
+        return dup(def);
+    }
+    if (lua_type(L, stack_pos) == LUA_TNUMBER) {
+        return dup(lua_tointeger(L, stack_pos));
+    }
+
+    return open(lua_tostring(L, stack_pos), O_RDWR | O_NOCTTY);
+}
+
+static void check_term_fd(lua_State* L, int stack_pos)
+{
+    if (!lua_isnoneornil(L, stack_pos) &&
+        lua_type(L, stack_pos) != LUA_TNUMBER) {
+        luaL_checkstring(L, stack_pos);
+    }
+}
+
+static void init_screen(screen* scr)
+{
+    memset(scr, 0, sizeof(screen));
+    scr->out_fd = -1;
+    scr->input_fd = -1;
+    scr->dyn.head = scr->dyn.tail = -1;
+}
 
+/* makes the screen at stack_pos (or the initscr one, if it is nil) the one
+ * everything applies to, from lua's side. ncurses has to be told separately */
+static void switch_screen(lua_State* L, screen* scr, int stack_pos)
+{
     lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    if (lua_isnil(L, stack_pos)) {
+        lua_getfield(L, -1, "initscr_state");
+    }
+    else {
+        lua_getfenv(L, stack_pos);
+    }
+    lua_setfield(L, -2, "screen_state");
+    lua_pushvalue(L, stack_pos);
+    lua_setfield(L, -2, "cur_screen");
+    lua_pop(L, 1);
 
-    /* figure out which pair value to use */
-    lua_getfield(L, -1, "color_pairs");
-    lua_getfield(L, -1, name);
-    if (lua_isnil(L, -1)) {
-        /* if it was nil, we want to set a new value in the color_pairs table,
-         * and we want to leave that C color_pair value on top of the stack
-         * for consistency */
+    cur_screen = scr;
+    if (scr->sp != NULL) {
+        init_chars();
+    }
+}
+
+/* this opens the terminal the same way initscr does, but keeps hold of it,
+ * so that set_term can switch back to it later. initscr exits when it can't
+ * open the terminal, so this returns false instead. called again, it makes
+ * the terminal current again */
+static int l_initscr(lua_State* L)
+{
+    SCREEN* sp;
+
+    init_locale();
+
+    if (initscr_screen.sp == NULL) {
+        sp = newterm(NULL, stdout, stdin);
+        if (sp == NULL) {
+            lua_pushboolean(L, FALSE);
+            return 1;
+        }
+        def_prog_mode();
+        initscr_screen.sp = sp;
+    }
+    else if (cur_screen != &initscr_screen) {
+        set_term(initscr_screen.sp);
+    }
+
+    /* newterm may have switched away from it */
+    if (cur_screen != &initscr_screen) {
+        lua_pushnil(L);
+        switch_screen(L, &initscr_screen, lua_gettop(L));
         lua_pop(L, 1);
-        lua_pushinteger(L, ++ncolor_pairs);
-        lua_pushvalue(L, -1);
-        lua_setfield(L, -3, name);
     }
-    name_val = lua_tointeger(L, -1);
-    lua_pop(L, 2);
+    init_chars();
+
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+static screen* check_screen(lua_State* L, int stack_pos)
+{
+    screen* scr;
+
+    scr = (screen*)luaL_checkudata(L, stack_pos, SCREEN_TABLE);
+    if (scr->sp == NULL) {
+        luaL_error(L, "Attempt to use a deleted screen");
+    }
+
+    return scr;
+}
+
+/* newterm([type [, out [, in [, opts]]]]) opens another terminal, and makes
+ * it the current one, returning a screen object for use with set_term. each
+ * screen has its own colors, color pairs and settings. out and in default to
+ * stdout and stdin, and can be file descriptors or paths. if opts.stats is
+ * set, output is routed through a stream which counts everything written to
+ * the terminal, for output_stats. opts.async does the same, but also lets
+ * refreshes return without waiting for the terminal to take their output,
+ * coalescing frames if it falls behind (see flush) */
+static int l_newterm(lua_State* L)
+{
+    const char* type;
+    int out_fd, in_fd, fd, stats = 0, async = 0;
+    term_output* output = NULL;
+    FILE* ofp;
+    FILE* ifp;
+    SCREEN* sp;
+    screen* scr;
+
+    type = luaL_optstring(L, 1, NULL);
+    if (lua_istable(L, 4)) {
+        lua_getfield(L, 4, "stats");
+        stats = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+
+        lua_getfield(L, 4, "async");
+        async = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    check_term_fd(L, 2);
+    check_term_fd(L, 3);
+    out_fd = get_term_fd(L, 2, fileno(stdout));
+    if (out_fd < 0) {
+        return luaL_error(L, "Couldn't open %s", lua_tostring(L, 2));
+    }
+    in_fd = get_term_fd(L, 3, fileno(stdin));
+    if (in_fd < 0) {
+        close(out_fd);
+        return luaL_error(L, "Couldn't open %s", lua_tostring(L, 3));
+    }
+    if (stats || async) {
+        output = output_open(out_fd);
+        if (output == NULL) {
+            close(out_fd);
+            close(in_fd);
+            lua_pushboolean(L, FALSE);
+            return 1;
+        }
+        fd = dup(output_term_fd(output));
+        ofp = fdopen(fd, "w");
+        if (ofp == NULL && fd >= 0) {
+            close(fd);
+        }
+    }
+    else {
+        ofp = fdopen(out_fd, "w");
+        if (ofp == NULL) {
+            close(out_fd);
+        }
+    }
+    ifp = fdopen(in_fd, "r");
+    if (ifp == NULL) {
+        close(in_fd);
+    }
+
+    init_locale();
+
+    if (ofp == NULL || ifp == NULL ||
+        (sp = newterm(type, ofp, ifp)) == NULL) {
+        if (ofp != NULL) {
+            fclose(ofp);
+        }
+        if (ifp != NULL) {
+            fclose(ifp);
+        }
+        if (output != NULL) {
+            output_close(output);
+            close(out_fd);
+        }
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    scr = lua_newuserdata(L, sizeof(screen));
+    init_screen(scr);
+    scr->sp = sp;
+    scr->ofp = ofp;
+    scr->ifp = ifp;
+    scr->input_fd = in_fd;
+    if (output != NULL) {
+        output_set_async(output, async);
+        output_hook_resize();
+        scr->output = output;
+        scr->out_fd = out_fd;
+    }
+    luaL_getmetatable(L, SCREEN_TABLE);
+    lua_setmetatable(L, -2);
+
+    /* the lua side of the screen's state, plus a weak table of its windows,
+     * which become unusable when the screen is deleted */
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushliteral(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_setfield(L, -2, "windows");
+    lua_setfenv(L, -2);
+
+    switch_screen(L, scr, lua_gettop(L));
+    sync_modes();
+
+    return 1;
+}
+
+/* set_term(screen) switches to another terminal opened by newterm, returning
+ * the previous one. the initscr one is nil, both ways */
+static int l_set_term(lua_State* L)
+{
+    screen* scr;
+
+    if (lua_isnoneornil(L, 1)) {
+        lua_settop(L, 1);
+        scr = &initscr_screen;
+        if (scr->sp == NULL) {
+            return luaL_error(L, "initscr hasn't been called");
+        }
+    }
+    else {
+        scr = check_screen(L, 1);
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    lua_getfield(L, -1, "cur_screen");
+    lua_remove(L, -2);
+
+    if (scr != cur_screen) {
+        set_term(scr->sp);
+        switch_screen(L, scr, 1);
+    }
+
+    return 1;
+}
+
+/* ends and frees a terminal, and every window on it. this happens when the
+ * screen is collected, but the current screen is never collected (until
+ * the lua state is closed) */
+static void close_screen(screen* scr)
+{
+    if (scr->sp == NULL) {
+        return;
+    }
+
+    if (scr == cur_screen) {
+        if (!isendwin()) {
+            flush_deferred();
+            endwin();
+        }
+        delscreen(scr->sp);
+        cur_screen = &initscr_screen;
+    }
+    else {
+        SCREEN* old;
+
+        old = set_term(scr->sp);
+        if (!isendwin()) {
+            endwin();
+        }
+        set_term(old);
+        delscreen(scr->sp);
+    }
+    scr->sp = NULL;
+    free(scr->rgb_lut);
+    scr->rgb_lut = NULL;
+
+    fclose(scr->ofp);
+    fclose(scr->ifp);
+    if (scr->output != NULL) {
+        output_close(scr->output);
+        close(scr->out_fd);
+        scr->output = NULL;
+    }
+    free_dyn_pairs(&scr->dyn);
+}
+
+static void invalidate_windows(lua_State* L, int stack_pos)
+{
+    lua_getfenv(L, stack_pos);
+    lua_getfield(L, -1, "windows");
+    if (lua_istable(L, -1)) {
+        lua_pushnil(L);
+        while (lua_next(L, -2) != 0) {
+            window* w;
+
+            w = lua_touserdata(L, -2);
+            if (w != NULL) {
+                w->win = NULL;
+            }
+            lua_pop(L, 1);
+        }
+    }
+    lua_pop(L, 2);
+}
+
+/* delscreen(screen) closes a terminal which isn't the current one */
+static int l_delscreen(lua_State* L)
+{
+    screen* scr;
+
+    scr = check_screen(L, 1);
+    if (scr == cur_screen) {
+        return luaL_error(L, "Can't delete the current screen");
+    }
+
+    invalidate_windows(L, 1);
+    close_screen(scr);
+
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+/* this also runs for every screen when the lua state is closed, before the
+ * library is unloaded, which the output relay threads mustn't outlive */
+static int l_screen_gc(lua_State* L)
+{
+    screen* scr;
+
+    scr = (screen*)luaL_checkudata(L, 1, SCREEN_TABLE);
+    if (scr->sp != NULL) {
+        invalidate_windows(L, 1);
+        close_screen(scr);
+    }
+
+    return 0;
+}
+
+/* returns false if output isn't being counted (see newterm). histogram maps
+ * the smallest byte count of each bucket to the number of refreshes which
+ * wrote at least that many bytes, but less than twice as many */
+static int l_output_stats(lua_State* L)
+{
+    output_stats stats;
+    int i;
+
+    if (cur_screen->output == NULL) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    output_get_stats(cur_screen->output, &stats);
+
+    lua_createtable(L, 0, 6);
+    lua_pushnumber(L, stats.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushnumber(L, stats.writes);
+    lua_setfield(L, -2, "writes");
+    lua_pushnumber(L, stats.refreshes);
+    lua_setfield(L, -2, "refreshes");
+    lua_pushnumber(L, stats.last_refresh);
+    lua_setfield(L, -2, "last_refresh");
+    lua_pushnumber(L, cur_screen->frames_coalesced);
+    lua_setfield(L, -2, "coalesced");
+
+    lua_newtable(L);
+    for (i = 0; i < OUTPUT_HISTOGRAM_SIZE; ++i) {
+        if (stats.histogram[i] > 0) {
+            lua_pushnumber(L, i == 0 ? 0 : 1UL << (i - 1));
+            lua_pushnumber(L, stats.histogram[i]);
+            lua_settable(L, -3);
+        }
+    }
+    lua_setfield(L, -2, "histogram");
+
+    return 1;
+}
+
+/* profile(on) turns profiling on or off. while it is on, the functions in
+ * the module and the window methods are replaced by closures which count
+ * their calls, the total time spent in them, and how much of that time was
+ * spent blocked in ncurses, waiting for input (getch) or for output to be
+ * written (refresh, doupdate, flush and endwin). turning it on resets the
+ * counts. functions copied out of the module before profiling was turned on
+ * aren't counted, and neither are calls which raise an error */
+static int l_profiled(lua_State* L)
+{
+    profile_entry* entry;
+    double start, blocked;
+    int nargs;
+
+    entry = lua_touserdata(L, lua_upvalueindex(2));
+    nargs = lua_gettop(L);
+    start = now();
+    blocked = blocked_time;
+
+    lua_pushvalue(L, lua_upvalueindex(1));
+    lua_insert(L, 1);
+    lua_call(L, nargs, LUA_MULTRET);
+
+    entry->calls++;
+    entry->time += now() - start;
+    entry->blocked += blocked_time - blocked;
+
+    return lua_gettop(L);
+}
+
+/* wraps (or unwraps) every c function in the table at stack_pos. entries is
+ * the table of counters, by name, which is shared between the module and the
+ * window methods */
+static void profile_table(lua_State* L, int stack_pos, int entries, int on)
+{
+    lua_pushnil(L);
+    while (lua_next(L, stack_pos) != 0) {
+        lua_CFunction f;
+
+        f = lua_tocfunction(L, -1);
+        if (lua_type(L, -2) != LUA_TSTRING || f == NULL ||
+            !strncmp(lua_tostring(L, -2), "profile", 7)) {
+            lua_pop(L, 1);
+            continue;
+        }
+
+        if (on && f != l_profiled) {
+            lua_pushvalue(L, -2);
+            lua_rawget(L, entries);
+            if (lua_isnil(L, -1)) {
+                lua_pop(L, 1);
+                memset(lua_newuserdata(L, sizeof(profile_entry)), 0,
+                       sizeof(profile_entry));
+                lua_pushvalue(L, -3);
+                lua_pushvalue(L, -2);
+                lua_rawset(L, entries);
+            }
+            lua_pushcclosure(L, l_profiled, 2);
+            lua_pushvalue(L, -2);
+            lua_insert(L, -2);
+            lua_rawset(L, stack_pos);
+        }
+        else if (!on && f == l_profiled) {
+            lua_getupvalue(L, -1, 1);
+            lua_pushvalue(L, -3);
+            lua_insert(L, -2);
+            lua_rawset(L, stack_pos);
+            lua_pop(L, 1);
+        }
+        else {
+            lua_pop(L, 1);
+        }
+    }
+}
+
+static int l_profile(lua_State* L)
+{
+    int on, top;
+
+    on = lua_toboolean(L, 1);
+    lua_settop(L, 0);
+
+    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    lua_getfield(L, 1, "profile");
+    if (on && lua_isnil(L, 2)) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, 1, "profile");
+    }
+    else if (on) {
+        /* the counters are reset in place, since functions which are
+         * already wrapped hold on to them */
+        lua_pushnil(L);
+        while (lua_next(L, 2) != 0) {
+            memset(lua_touserdata(L, -1), 0, sizeof(profile_entry));
+            lua_pop(L, 1);
+        }
+    }
+    if (lua_isnil(L, 2)) {
+        lua_pushboolean(L, TRUE);
+        return 1;
+    }
+
+    lua_getfield(L, LUA_REGISTRYINDEX, "_LOADED");
+    lua_getfield(L, -1, "curses");
+    luaL_getmetatable(L, WINDOW_TABLE);
+    lua_getfield(L, -1, "__index");
+    top = lua_gettop(L);
+
+    profile_table(L, top, 2, on);
+    if (lua_istable(L, top - 2)) {
+        profile_table(L, top - 2, 2, on);
+    }
+    profiling = on;
+
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+/* returns a table of {calls =, time =, blocked =} by function name, for the
+ * functions called since profiling was last turned on. times are in
+ * seconds */
+static int l_profile_report(lua_State* L)
+{
+    lua_newtable(L);
+    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    lua_getfield(L, -1, "profile");
+    lua_remove(L, -2);
+    if (lua_isnil(L, -1)) {
+        lua_pop(L, 1);
+        return 1;
+    }
+
+    lua_pushnil(L);
+    while (lua_next(L, -2) != 0) {
+        profile_entry* entry;
+
+        entry = lua_touserdata(L, -1);
+        if (entry->calls > 0) {
+            lua_pushvalue(L, -2);
+            lua_createtable(L, 0, 3);
+            lua_pushnumber(L, entry->calls);
+            lua_setfield(L, -2, "calls");
+            lua_pushnumber(L, entry->time);
+            lua_setfield(L, -2, "time");
+            lua_pushnumber(L, entry->blocked);
+            lua_setfield(L, -2, "blocked");
+            lua_settable(L, -6);
+        }
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    return 1;
+}
+
+static int l_endwin(lua_State* L)
+{
+    double blocked;
+
+    flush_deferred();
+    lua_pushboolean(L, endwin() == OK);
+    if (cur_screen->output != NULL) {
+        blocked = begin_blocking();
+        output_wait(cur_screen->output);
+        end_blocking(blocked);
+    }
+    sync_modes();
+    return 1;
+}
+
+static int l_isendwin(lua_State* L)
+{
+    lua_pushboolean(L, isendwin());
+    return 1;
+}
+
+static int l_start_color(lua_State* L)
+{
+    if (has_colors()) {
+        init_color_pairs(L);
+        init_colors(L);
+        if (start_color() == OK) {
+            init_dyn_pairs(&cur_screen->dyn);
+            lua_pushboolean(L, TRUE);
+        }
+        else {
+            lua_pushboolean(L, FALSE);
+        }
+    }
+    else {
+        lua_pushboolean(L, FALSE);
+    }
+
+    return 1;
+}
+
+static int l_use_default_colors(lua_State* L)
+{
+    register_default_color(L);
+    lua_pushboolean(L, use_default_colors() == OK);
+    return 1;
+}
+
+static int l_assume_default_colors(lua_State* L)
+{
+    const char* fg;
+    const char* bg;
+    int nfg, nbg;
+
+    register_default_color(L);
+
+    fg = luaL_optlstring(L, 1, "default", NULL);
+    bg = luaL_optlstring(L, 2, "default", NULL);
+
+    push_screen_state(L);
+    lua_getfield(L, -1, "colors");
+    lua_getfield(L, -1, fg);
+    nfg = luaL_checkint(L, -1);
+    lua_pop(L, 1);
+
+    lua_getfield(L, -1, bg);
+    nbg = luaL_checkint(L, -1);
+    lua_pop(L, 3);
+
+    lua_pushboolean(L, assume_default_colors(nfg, nbg) == OK);
+    return 1;
+}
+
+static int l_setup_term(lua_State* L)
+{
+    int ret = 0, arg = 1;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    luaL_checktype(L, arg, LUA_TTABLE);
+
+    lua_pushnil(L);
+    while (lua_next(L, arg) != 0) {
+        if (lua_isstring(L, -2)) {
+            const char* str;
+
+            str = lua_tostring(L, -2);
+            if (!strcmp(str, "cbreak")) {
+                ret += ((lua_toboolean(L, -1) ? cbreak() : nocbreak()) == OK);
+            }
+            else if (!strcmp(str, "echo")) {
+                ret += ((lua_toboolean(L, -1) ? echo() : noecho()) == OK);
+            }
+            else if (!strcmp(str, "halfdelay")) {
+                ret += (halfdelay(lua_tointeger(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "intrflush")) {
+                ret += (intrflush(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "keypad")) {
+                ret += (keypad(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "meta")) {
+                ret += (meta(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "nodelay")) {
+                ret += (nodelay(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "raw")) {
+                ret += ((lua_toboolean(L, -1) ? raw() : noraw()) == OK);
+            }
+            else if (!strcmp(str, "qiflush")) {
+                lua_toboolean(L, -1) ? qiflush() : noqiflush();
+                ret++;
+            }
+            else if (!strcmp(str, "timeout")) {
+                if (lua_isnil(L, -1)) {
+                    ret += (notimeout(win, TRUE) == OK);
+                }
+                else {
+                    wtimeout(win, lua_tointeger(L, -1));
+                    ret++;
+                }
+            }
+            else if (!strcmp(str, "typeahead")) {
+                ret += ((lua_toboolean(L, -1) ? typeahead(0) :
+                                                typeahead(-1)) == OK);
+            }
+            else if (!strcmp(str, "clear")) {
+                ret += (clearok(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "idl")) {
+                ret += (idlok(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "idc")) {
+                idcok(win, lua_toboolean(L, -1));
+                ret++;
+            }
+            else if (!strcmp(str, "immed")) {
+                immedok(win, lua_toboolean(L, -1));
+                ret++;
+            }
+            else if (!strcmp(str, "leave")) {
+                ret += (leaveok(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "scroll")) {
+                ret += (scrollok(win, lua_toboolean(L, -1)) == OK);
+            }
+            else if (!strcmp(str, "max_fps")) {
+                /* refresh and doupdate only update the terminal at most
+                 * this often; 0 or false removes the limit */
+                double fps;
+
+                fps = lua_tonumber(L, -1);
+                cur_screen->update_interval = fps > 0 ? 1 / fps : 0;
+                ret++;
+            }
+            else if (!strcmp(str, "resize_delay")) {
+                /* getch only reports the last of a burst of resizes, once
+                 * there have been none for this many milliseconds */
+                cur_screen->resize_delay = lua_tointeger(L, -1);
+                ret++;
+            }
+            else if (!strcmp(str, "keycodes")) {
+                cur_screen->raw_keycodes = lua_toboolean(L, -1);
+                ret++;
+            }
+            else if (!strcmp(str, "nl")) {
+                ret += ((lua_toboolean(L, -1) ? nl() : nonl()) == OK);
+            }
+            else {
+                luaL_error(L, "Unknown or unimplemented terminal mode %s", str);
+            }
+        }
+        lua_pop(L, 1);
+    }
+    sync_modes();
+
+    lua_pushnumber(L, ret);
+    return 1;
+}
+
+/* init_color(name, r, g, b), init_color(name, {r =, g =, b =}) or
+ * init_color(name, "#rrggbb") defines the named color, with components from
+ * 0 to 255. where the terminal can't change its colors, the name is given
+ * the nearest one it has instead. returns the color number */
+static int l_init_color(lua_State* L)
+{
+    const char* name;
+    int rgb[3], i;
+
+    name = luaL_checklstring(L, 1, NULL);
+
+    if (lua_type(L, 2) == LUA_TSTRING) {
+        luaL_argcheck(L, parse_rgb(lua_tostring(L, 2), rgb), 2,
+                      "expected a color of the form #rrggbb");
+    }
+    else if (lua_istable(L, 2)) {
+        lua_getfield(L, 2, "r");
+        lua_getfield(L, 2, "g");
+        lua_getfield(L, 2, "b");
+        for (i = 0; i < 3; ++i) {
+            rgb[i] = luaL_checkint(L, i - 3);
+        }
+        lua_pop(L, 3);
+    }
+    else {
+        for (i = 0; i < 3; ++i) {
+            rgb[i] = luaL_checkint(L, i + 2);
+        }
+    }
+    for (i = 0; i < 3; ++i) {
+        luaL_argcheck(L, rgb[i] >= 0 && rgb[i] <= 255, 2,
+                      "color components must be from 0 to 255");
+    }
+
+    lua_pushinteger(L, define_rgb_color(L, name, rgb[0], rgb[1], rgb[2]));
+    return 1;
+}
+
+static int l_init_pair(lua_State* L)
+{
+    const char *name, *fg, *bg;
+    int name_val, fg_val, bg_val;
+
+    /* check the arguments, and get them */
+    name = luaL_checklstring(L, 1, NULL);
+    if (cur_screen->default_color_available) {
+        fg =   luaL_optlstring(L, 2, "default", NULL);
+        bg =   luaL_optlstring(L, 3, "default", NULL);
+    }
+    else {
+        fg =   luaL_optlstring(L, 2, "white", NULL);
+        bg =   luaL_optlstring(L, 3, "black", NULL);
+    }
+
+    push_screen_state(L);
+
+    /* figure out which pair value to use */
+    lua_getfield(L, -1, "color_pairs");
+    lua_getfield(L, -1, name);
+    if (lua_isnil(L, -1)) {
+        /* if it was nil, we want to set a new value in the color_pairs table,
+         * and we want to leave that C color_pair value on top of the stack
+         * for consistency */
+        lua_pop(L, 1);
+        /* dynamic pairs which are still pinned can't be taken over, so they
+         * are skipped, and just stay dynamic */
+        do {
+            ++cur_screen->ncolor_pairs;
+        } while (dyn_pair_pinned(&cur_screen->dyn, cur_screen->ncolor_pairs));
+        if (cur_screen->dyn.pairs != NULL &&
+            cur_screen->ncolor_pairs >= cur_screen->dyn.max_pairs) {
+            /* out of pairs which fit in a style */
+            cur_screen->ncolor_pairs = cur_screen->dyn.max_pairs - 1;
+            lua_pop(L, 2);
+            lua_pushboolean(L, FALSE);
+            return 1;
+        }
+        lua_pushinteger(L, cur_screen->ncolor_pairs);
+        release_dyn_pair(&cur_screen->dyn, cur_screen->ncolor_pairs);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, name);
+    }
+    name_val = lua_tointeger(L, -1);
+    lua_pop(L, 3);
+
+    /* figure out which foreground value to use */
+    if (!lookup_color(L, fg, &fg_val)) {
+        return luaL_error(L, "init_pair: Trying to use a non-existant foreground color: \"%s\"", fg);
+    }
+
+    /* and background value */
+    if (!lookup_color(L, bg, &bg_val)) {
+        return luaL_error(L, "init_pair: Trying to use a non-existant background color: \"%s\"", bg);
+    }
+
+    if (name_val != 0) {
+        lua_pushboolean(L, (init_pair(name_val, fg_val, bg_val) == OK));
+    }
+    else {
+        lua_pushboolean(L, (assume_default_colors(fg_val, bg_val) == OK));
+    }
+    return 1;
+}
+
+/* alloc_pair([fg [, bg]]) returns the attribute for a dynamic pair with the
+ * given colors. the pair is pinned until it is given back with free_pair */
+static int l_alloc_pair(lua_State* L)
+{
+    int fg = -1, bg = -1, pair;
+
+    if (!cur_screen->default_color_available) {
+        fg = COLOR_WHITE;
+        bg = COLOR_BLACK;
+    }
+    if (!lua_isnoneornil(L, 1)) {
+        fg = get_color_val(L, 1);
+    }
+    if (!lua_isnoneornil(L, 2)) {
+        bg = get_color_val(L, 2);
+    }
+
+    pair = alloc_dyn_pair(&cur_screen->dyn, cur_screen->ncolor_pairs,
+                          fg, bg);
+    if (pair == -1) {
+        lua_pushboolean(L, FALSE);
+    }
+    else {
+        pin_dyn_pair(&cur_screen->dyn, pair);
+        lua_pushnumber(L, COLOR_PAIR(pair));
+    }
+
+    return 1;
+}
+
+/* free_pair(style) drops a pin taken on the style's pair by alloc_pair or
+ * style, so that it can be evicted again once nothing else holds it. returns
+ * whether there was a pin to drop */
+static int l_free_pair(lua_State* L)
+{
+    chtype style;
+
+    style = (chtype)luaL_checknumber(L, 1);
+
+    lua_pushboolean(L, unpin_dyn_pair(&cur_screen->dyn, PAIR_NUMBER(style)));
+    return 1;
+}
+
+/* every key name getch can return is created once, when the module is
+ * loaded, and kept in a table indexed by key code, so returning a key
+ * doesn't create or hash any strings */
+static void init_key_names(lua_State* L)
+{
+    int c;
+
+    lua_createtable(L, KEY_MAX + 1, 0);
+    for (c = 0; c <= KEY_MAX; ++c) {
+        const char* key_name;
+
+        key_name = get_key_str(c);
+        if (key_name != NULL) {
+            lua_pushstring(L, key_name);
+        }
+        else if (c <= UCHAR_MAX) {
+            char s;
+
+            s = c;
+            lua_pushlstring(L, &s, 1);
+        }
+        else {
+            continue;
+        }
+        lua_rawseti(L, -2, c);
+    }
+    key_names_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/* curses.KEY maps key names to the codes getch returns in keycodes mode */
+static void init_key_codes(lua_State* L)
+{
+    int c;
+
+    lua_newtable(L);
+    for (c = KEY_MIN; c <= KEY_MAX; ++c) {
+        const char* key_name;
+
+        key_name = get_key_str(c);
+        if (key_name != NULL) {
+            lua_pushinteger(L, c);
+            lua_setfield(L, -2, key_name);
+        }
+    }
+    lua_setfield(L, -2, "KEY");
+}
+
+static void push_key_name(lua_State* L, int c)
+{
+    lua_rawgeti(L, LUA_REGISTRYINDEX, key_names_ref);
+    lua_rawgeti(L, -1, c);
+    if (lua_isnil(L, -1)) {
+        char s;
+
+        lua_pop(L, 1);
+        s = c;
+        lua_pushlstring(L, &s, 1);
+    }
+    lua_replace(L, -2);
+}
+
+static void push_key(lua_State* L, int c)
+{
+    if (cur_screen->raw_keycodes) {
+        lua_pushinteger(L, c);
+        return;
+    }
+
+    push_key_name(L, c);
+}
+
+/* the name getch would return for a key code */
+static int l_keyname(lua_State* L)
+{
+    push_key_name(L, luaL_checkint(L, 1));
+    return 1;
+}
+
+/* the mv* variants of the drawing functions take the position as two
+ * integers, y and x, rather than as a table, so they don't need anything
+ * allocated per call */
+static void get_mv_pos(lua_State* L, int* stack_pos, pos* p)
+{
+    p->y = luaL_checkint(L, *stack_pos);
+    p->x = luaL_checkint(L, *stack_pos + 1);
+    *stack_pos += 2;
+}
+
+/* waits until a burst of resizes is over (or a key is pressed, which is
+ * pushed back to be read next), so that getch only reports it once */
+static void coalesce_resize(WINDOW* win)
+{
+    int c, delay;
+    double blocked;
+
+    delay = wgetdelay(win);
+    wtimeout(win, cur_screen->resize_delay);
+    blocked = begin_blocking();
+    while ((c = wgetch(win)) == KEY_RESIZE);
+    end_blocking(blocked);
+    if (c != ERR) {
+        ungetch(c);
+    }
+    wtimeout(win, delay);
+}
+
+static int get_key(lua_State* L, WINDOW* win, pos* p)
+{
+    int c;
+    double blocked;
+
+    flush_before_input(win);
+    sync_modes();
+    blocked = begin_blocking();
+    if (p != NULL) {
+        c = mvwgetch(win, p->y, p->x);
+    }
+    else {
+        c = wgetch(win);
+    }
+    end_blocking(blocked);
+    if (c == ERR) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    if (c == KEY_RESIZE && cur_screen->resize_delay > 0) {
+        coalesce_resize(win);
+    }
+
+    push_key(L, c);
+    return 1;
+}
+
+static int l_getch(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    return get_key(L, win, get_pos(L, win, &arg, &p) ? &p : NULL);
+}
+
+static int l_mvgetch(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    get_mv_pos(L, &arg, &p);
+    return get_key(L, win, &p);
+}
+
+/* read every key which is already waiting, without blocking, into a table
+ * which is reused between calls (either one passed in, or our own) */
+static int l_getch_all(lua_State* L)
+{
+    int c, n = 0, old_len, delay, arg = 1, resized = 0;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    if (lua_istable(L, arg)) {
+        lua_pushvalue(L, arg);
+    }
+    else {
+        lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+        lua_getfield(L, -1, "getch_buf");
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, "getch_buf");
+        }
+        lua_remove(L, -2);
+    }
+    old_len = lua_objlen(L, -1);
+
+    if (cur_screen->frame_deferred) {
+        update_screen();
+    }
+    sync_modes();
+    delay = wgetdelay(win);
+    wtimeout(win, 0);
+    while ((c = wgetch(win)) != ERR) {
+        /* with resize_delay set, resizes are only reported once per batch */
+        if (c == KEY_RESIZE && cur_screen->resize_delay > 0) {
+            if (resized) {
+                continue;
+            }
+            resized = 1;
+        }
+        push_key(L, c);
+        lua_rawseti(L, -2, ++n);
+    }
+    wtimeout(win, delay);
+
+    while (old_len > n) {
+        lua_pushnil(L);
+        lua_rawseti(L, -2, old_len--);
+    }
+
+    lua_pushinteger(L, n);
+    return 2;
+}
+
+/* the file descriptor input is read from, for use with poll and friends.
+ * note that ncurses may already have buffered some input (partial escape
+ * sequences, or keys pushed back with ungetch), so after the fd becomes
+ * readable, getch_all should be used to drain everything */
+static int l_input_fd(lua_State* L)
+{
+    if (cur_screen->input_fd >= 0) {
+        lua_pushinteger(L, cur_screen->input_fd);
+    }
+    else {
+        lua_pushinteger(L, fileno(stdin));
+    }
+    return 1;
+}
+
+/* mouse support. events are described by name: "all", "position" (motion
+ * reporting), "buttonN" for every event on button N, or "buttonN_pressed",
+ * "buttonN_released", "buttonN_clicked", "buttonN_double_clicked" and
+ * "buttonN_triple_clicked" */
+typedef struct _mouse_event {
+    const char* str;
+    int tag;
+} mouse_event;
+
+static mouse_event mouse_events[] = {
+    {"pressed",        NCURSES_BUTTON_PRESSED},
+    {"released",       NCURSES_BUTTON_RELEASED},
+    {"clicked",        NCURSES_BUTTON_CLICKED},
+    {"double_clicked", NCURSES_DOUBLE_CLICKED},
+    {"triple_clicked", NCURSES_TRIPLE_CLICKED},
+};
+
+#define NMOUSE_EVENTS (int)(sizeof(mouse_events) / sizeof(mouse_events[0]))
+#define NMOUSE_BUTTONS 5
+
+static mmask_t get_mouse_mask(lua_State* L, const char* str)
+{
+    int button, i;
+
+    if (!strcmp(str, "all")) {
+        return ALL_MOUSE_EVENTS;
+    }
+    if (!strcmp(str, "position")) {
+        return REPORT_MOUSE_POSITION;
+    }
+
+    if (strncmp(str, "button", 6) || str[6] < '1' ||
+        str[6] > '0' + NMOUSE_BUTTONS) {
+        return luaL_error(L, "Unknown mouse event \"%s\"", str);
+    }
+    button = str[6] - '0';
+
+    if (str[7] == '\0') {
+        return NCURSES_MOUSE_MASK(button, NCURSES_BUTTON_PRESSED |
+                                          NCURSES_BUTTON_RELEASED |
+                                          NCURSES_BUTTON_CLICKED |
+                                          NCURSES_DOUBLE_CLICKED |
+                                          NCURSES_TRIPLE_CLICKED);
+    }
+    if (str[7] == '_') {
+        for (i = 0; i < NMOUSE_EVENTS; ++i) {
+            if (!strcmp(str + 8, mouse_events[i].str)) {
+                return NCURSES_MOUSE_MASK(button, mouse_events[i].tag);
+            }
+        }
+    }
+
+    return luaL_error(L, "Unknown mouse event \"%s\"", str);
+}
+
+static int l_mousemask(lua_State* L)
+{
+    mmask_t mask = 0, old_mask = 0, new_mask;
+    int i, n;
+
+    n = lua_gettop(L);
+    for (i = 1; i <= n; ++i) {
+        if (lua_istable(L, i)) {
+            int j;
+
+            for (j = 1; ; ++j) {
+                lua_rawgeti(L, i, j);
+                if (lua_isnil(L, -1)) {
+                    lua_pop(L, 1);
+                    break;
+                }
+                mask |= get_mouse_mask(L, luaL_checklstring(L, -1, NULL));
+                lua_pop(L, 1);
+            }
+        }
+        else if (lua_isboolean(L, i)) {
+            if (lua_toboolean(L, i)) {
+                mask |= ALL_MOUSE_EVENTS;
+            }
+        }
+        else {
+            mask |= get_mouse_mask(L, luaL_checklstring(L, i, NULL));
+        }
+    }
+
+    new_mask = mousemask(mask, &old_mask);
+
+    lua_pushnumber(L, new_mask);
+    lua_pushnumber(L, old_mask);
+    return 2;
+}
+
+static int l_mouseinterval(lua_State* L)
+{
+    lua_pushinteger(L, mouseinterval(luaL_optint(L, 1, -1)));
+    return 1;
+}
+
+static int l_has_mouse(lua_State* L)
+{
+    lua_pushboolean(L, has_mouse());
+    return 1;
+}
+
+/* fill in the fields of the event table, which is either passed in or
+ * reused between calls, so that decoding a stream of motion events doesn't
+ * create any garbage */
+static int l_getmouse(lua_State* L)
+{
+    MEVENT ev;
+    int button, i;
+    const char* event = NULL;
+
+    if (lua_istable(L, 1)) {
+        lua_pushvalue(L, 1);
+    }
+    else {
+        lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+        lua_getfield(L, -1, "mouse_event");
+        if (lua_isnil(L, -1)) {
+            lua_pop(L, 1);
+            lua_newtable(L);
+            lua_pushvalue(L, -1);
+            lua_setfield(L, -3, "mouse_event");
+        }
+        lua_remove(L, -2);
+    }
+
+    if (getmouse(&ev) != OK) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    lua_pushinteger(L, ev.id);
+    lua_setfield(L, -2, "id");
+    lua_pushinteger(L, ev.y);
+    lua_setfield(L, -2, "y");
+    lua_pushinteger(L, ev.x);
+    lua_setfield(L, -2, "x");
+    lua_pushinteger(L, ev.z);
+    lua_setfield(L, -2, "z");
+    lua_pushnumber(L, ev.bstate);
+    lua_setfield(L, -2, "bstate");
+
+    button = 0;
+    for (i = 1; i <= NMOUSE_BUTTONS && event == NULL; ++i) {
+        int j;
+
+        for (j = 0; j < NMOUSE_EVENTS; ++j) {
+            if (ev.bstate & NCURSES_MOUSE_MASK(i, mouse_events[j].tag)) {
+                button = i;
+                event = mouse_events[j].str;
+                break;
+            }
+        }
+    }
+    if (event == NULL && (ev.bstate & REPORT_MOUSE_POSITION)) {
+        event = "moved";
+    }
+
+    lua_pushinteger(L, button);
+    lua_setfield(L, -2, "button");
+    if (event != NULL) {
+        lua_pushstring(L, event);
+    }
+    else {
+        lua_pushnil(L);
+    }
+    lua_setfield(L, -2, "event");
+    lua_pushboolean(L, ev.bstate & BUTTON_SHIFT);
+    lua_setfield(L, -2, "shift");
+    lua_pushboolean(L, ev.bstate & BUTTON_CTRL);
+    lua_setfield(L, -2, "ctrl");
+    lua_pushboolean(L, ev.bstate & BUTTON_ALT);
+    lua_setfield(L, -2, "alt");
+
+    return 1;
+}
+
+static int l_ungetch(lua_State* L)
+{
+    int ch;
+
+    if (lua_type(L, 1) == LUA_TNUMBER) {
+        ch = lua_tointeger(L, 1);
+    }
+    else {
+        ch = get_key_enum(luaL_checklstring(L, 1, NULL));
+    }
+
+    lua_pushboolean(L, ungetch(ch) == OK);
+    return 1;
+}
+
+static int l_move(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    if (get_pos(L, win, &arg, &p)) {
+        lua_pushboolean(L, (wmove(win, p.y, p.x) == OK));
+    }
+    else {
+        int x, y;
+
+        y = luaL_checkint(L, arg);
+        x = luaL_checkint(L, arg + 1);
+
+        lua_pushboolean(L, (wmove(win, y, x) == OK));
+    }
+
+    return 1;
+}
+
+static int add_ch(lua_State* L, WINDOW* win, pos* p, int arg)
+{
+    const char* str;
+    size_t len;
+    chtype ch;
+
+    str = luaL_checklstring(L, arg, &len);
+
+    if ((unsigned char)str[0] & 0x80) {
+        cchar_t cc;
+
+        get_wide_char(&cc, str, len, get_style(L, arg + 1));
+        if (p != NULL) {
+            lua_pushboolean(L, mvwadd_wch(win, p->y, p->x, &cc) == OK);
+        }
+        else {
+            lua_pushboolean(L, wadd_wch(win, &cc) == OK);
+        }
+
+        return 1;
+    }
+
+    ch = get_char_enum(str);
+    ch |= get_style(L, arg + 1);
+
+    if (p != NULL) {
+        lua_pushboolean(L, mvwaddch(win, p->y, p->x, ch) == OK);
+    }
+    else {
+        lua_pushboolean(L, waddch(win, ch) == OK);
+    }
+
+    return 1;
+}
+
+static int l_addch(lua_State* L)
+{
+    int is_mv, arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    is_mv = get_pos(L, win, &arg, &p);
+    return add_ch(L, win, is_mv ? &p : NULL, arg);
+}
+
+static int l_mvaddch(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    get_mv_pos(L, &arg, &p);
+    return add_ch(L, win, &p, arg);
+}
+
+static int l_echochar(lua_State* L)
+{
+    int is_mv, arg = 1;
+    pos p;
+    WINDOW* win;
+    const char* str;
+    size_t len;
+    chtype ch;
+
+    win = get_window(L, &arg);
+    is_mv = get_pos(L, win, &arg, &p);
+    str = luaL_checklstring(L, arg, &len);
+
+    if (is_mv && wmove(win, p.y, p.x) != OK) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    if ((unsigned char)str[0] & 0x80) {
+        cchar_t cc;
+
+        get_wide_char(&cc, str, len, get_style(L, arg + 1));
+        lua_pushboolean(L, wecho_wchar(win, &cc) == OK);
+    }
+    else {
+        ch = get_char_enum(str);
+        ch |= get_style(L, arg + 1);
+        lua_pushboolean(L, wechochar(win, ch) == OK);
+    }
+
+    return 1;
+}
+
+/* draws a utf-8 string, at p if it is given, in the given style if there is
+ * one (leaving the window's own attributes alone) */
+static int add_str(WINDOW* win, pos* p, const char* str, size_t len,
+                   int set_attrs, chtype style)
+{
+    int ret;
+    attr_t old_mode = 0;
+    short old_color = 0;
+
+    if (set_attrs) {
+        wattr_get(win, &old_mode, &old_color, NULL);
+        wattr_set(win, style & A_ATTRIBUTES & ~A_COLOR, PAIR_NUMBER(style),
+                  NULL);
+    }
+
+    if (is_ascii(str, len)) {
+        if (p != NULL) {
+            ret = mvwaddnstr(win, p->y, p->x, str, len);
+        }
+        else {
+            ret = waddnstr(win, str, len);
+        }
+    }
+    else {
+        wchar_t* wstr;
+        int wlen;
+
+        wstr = decode_utf8_str(str, len, &wlen);
+        if (wstr == NULL) {
+            ret = ERR;
+        }
+        else if (p != NULL) {
+            ret = mvwaddnwstr(win, p->y, p->x, wstr, wlen);
+        }
+        else {
+            ret = waddnwstr(win, wstr, wlen);
+        }
+    }
+
+    if (set_attrs) {
+        wattr_set(win, old_mode, old_color, NULL);
+    }
+
+    return ret;
+}
+
+static int add_str_arg(lua_State* L, WINDOW* win, pos* p, int arg)
+{
+    const char* str;
+    size_t len;
+    int set_attrs;
+    chtype style = 0;
+
+    str = luaL_checklstring(L, arg, &len);
+    set_attrs = is_style(L, arg + 1);
+    if (set_attrs) {
+        style = get_style(L, arg + 1);
+    }
+
+    lua_pushboolean(L, add_str(win, p, str, len, set_attrs, style) == OK);
+    return 1;
+}
+
+static int l_addstr(lua_State* L)
+{
+    int is_mv, arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    is_mv = get_pos(L, win, &arg, &p);
+    return add_str_arg(L, win, is_mv ? &p : NULL, arg);
+}
+
+static int l_mvaddstr(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    get_mv_pos(L, &arg, &p);
+    return add_str_arg(L, win, &p, arg);
+}
+
+static int del_ch(lua_State* L, WINDOW* win, pos* p)
+{
+    if (p != NULL) {
+        lua_pushboolean(L, mvwdelch(win, p->y, p->x) == OK);
+    }
+    else {
+        lua_pushboolean(L, wdelch(win) == OK);
+    }
+
+    return 1;
+}
+
+static int l_delch(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    return del_ch(L, win, get_pos(L, win, &arg, &p) ? &p : NULL);
+}
+
+static int l_mvdelch(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    get_mv_pos(L, &arg, &p);
+    return del_ch(L, win, &p);
+}
+
+static int ins_ch(lua_State* L, WINDOW* win, pos* p, int arg)
+{
+    const char* str;
+    size_t len;
+    chtype ch;
+
+    str = luaL_checklstring(L, arg, &len);
+
+    if ((unsigned char)str[0] & 0x80) {
+        cchar_t cc;
+
+        get_wide_char(&cc, str, len, get_style(L, arg + 1));
+        if (p != NULL) {
+            lua_pushboolean(L, mvwins_wch(win, p->y, p->x, &cc) == OK);
+        }
+        else {
+            lua_pushboolean(L, wins_wch(win, &cc) == OK);
+        }
+
+        return 1;
+    }
+
+    ch = get_char_enum(str);
+    ch |= get_style(L, arg + 1);
+
+    if (p != NULL) {
+        lua_pushboolean(L, mvwinsch(win, p->y, p->x, ch) == OK);
+    }
+    else {
+        lua_pushboolean(L, winsch(win, ch) == OK);
+    }
+
+    return 1;
+}
+
+static int l_insch(lua_State* L)
+{
+    int is_mv, arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    is_mv = get_pos(L, win, &arg, &p);
+    return ins_ch(L, win, is_mv ? &p : NULL, arg);
+}
+
+static int l_mvinsch(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    get_mv_pos(L, &arg, &p);
+    return ins_ch(L, win, &p, arg);
+}
+
+static int ins_str(lua_State* L, WINDOW* win, pos* p, int arg)
+{
+    int set_attrs = 0, ret;
+    const char* str;
+    size_t len;
+    attr_t old_mode = 0;
+    short old_color = 0;
+
+    str = luaL_checklstring(L, arg, &len);
+    if (is_style(L, arg + 1)) {
+        int new_mode, new_color;
+
+        set_attrs = 1;
+        wattr_get(win, &old_mode, &old_color, NULL);
+        new_mode = get_style(L, arg + 1);
+        new_color = PAIR_NUMBER(new_mode);
+        new_mode &= A_ATTRIBUTES & ~A_COLOR;
+        wattr_set(win, new_mode, new_color, NULL);
+    }
+
+    if (is_ascii(str, len)) {
+        if (p != NULL) {
+            ret = mvwinsnstr(win, p->y, p->x, str, len);
+        }
+        else {
+            ret = winsnstr(win, str, len);
+        }
+    }
+    else {
+        wchar_t* wstr;
+        int wlen;
+
+        wstr = decode_utf8_str(str, len, &wlen);
+        if (wstr == NULL) {
+            ret = ERR;
+        }
+        else if (p != NULL) {
+            ret = mvwins_nwstr(win, p->y, p->x, wstr, wlen);
+        }
+        else {
+            ret = wins_nwstr(win, wstr, wlen);
+        }
+    }
+    lua_pushboolean(L, ret == OK);
+
+    if (set_attrs) {
+        wattr_set(win, old_mode, old_color, NULL);
+    }
+
+    return 1;
+}
+
+static int l_insstr(lua_State* L)
+{
+    int is_mv, arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    is_mv = get_pos(L, win, &arg, &p);
+    return ins_str(L, win, is_mv ? &p : NULL, arg);
+}
+
+static int l_mvinsstr(lua_State* L)
+{
+    int arg = 1;
+    pos p;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    get_mv_pos(L, &arg, &p);
+    return ins_str(L, win, &p, arg);
+}
+
+static int l_insdelln(lua_State* L)
+{
+    int n, arg = 1;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    n = luaL_checkint(L, arg);
+
+    lua_pushboolean(L, (winsdelln(win, n) == OK));
+    return 1;
+}
+
+static int l_getmaxyx(lua_State* L)
+{
+    int x, y, arg = 1;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    getmaxyx(win, y, x);
+
+    lua_pushnumber(L, y);
+    lua_pushnumber(L, x);
+    return 2;
+}
+
+static int l_getyx(lua_State* L)
+{
+    int x, y, arg = 1;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    getyx(win, y, x);
+
+    lua_pushnumber(L, y);
+    lua_pushnumber(L, x);
+    return 2;
+}
+
+static int l_getbegyx(lua_State* L)
+{
+    int x, y, arg = 1;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+    getbegyx(win, y, x);
+
+    lua_pushnumber(L, y);
+    lua_pushnumber(L, x);
+    return 2;
+}
+
+/* window objects. the window functions all accept a window as their first
+ * argument (and act on stdscr when there isn't one), which means the same
+ * functions can be used as methods */
+static window* push_window(lua_State* L, WINDOW* win, int owned, int parent)
+{
+    window* w;
+
+    w = lua_newuserdata(L, sizeof(window));
+    w->win = win;
+    w->owned = owned;
+    w->is_pad = 0;
+    w->view_moved = 0;
+
+    luaL_getmetatable(L, WINDOW_TABLE);
+    lua_setmetatable(L, -2);
+
+    /* subwindows share memory with their parent, so keep the parent alive
+     * for as long as the subwindow is. windows on a screen opened by newterm
+     * keep it alive too, and are registered with it */
+    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    lua_getfield(L, -1, "cur_screen");
+    lua_remove(L, -2);
+    if (parent || !lua_isnil(L, -1)) {
+        lua_createtable(L, 1, 1);
+        if (parent) {
+            lua_pushvalue(L, parent);
+            lua_rawseti(L, -2, 1);
+        }
+        if (!lua_isnil(L, -2)) {
+            lua_pushvalue(L, -2);
+            lua_setfield(L, -2, "screen");
+
+            lua_getfenv(L, -2);
+            lua_getfield(L, -1, "windows");
+            lua_pushvalue(L, -5);
+            lua_pushboolean(L, TRUE);
+            lua_rawset(L, -3);
+            lua_pop(L, 2);
+        }
+        lua_setfenv(L, -3);
+    }
+    lua_pop(L, 1);
+
+    return w;
+}
+
+static int l_stdscr(lua_State* L)
+{
+    if (stdscr == NULL) {
+        return luaL_error(L, "stdscr is not available before initscr");
+    }
+
+    push_window(L, stdscr, 0, 0);
+    return 1;
+}
+
+static int l_newwin(lua_State* L)
+{
+    int h, w, y, x;
+    WINDOW* win;
+
+    h = luaL_checkint(L, 1);
+    w = luaL_checkint(L, 2);
+    y = luaL_optint(L, 3, 0);
+    x = luaL_optint(L, 4, 0);
+
+    win = newwin(h, w, y, x);
+    if (win == NULL) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    push_window(L, win, 1, 0);
+    return 1;
+}
+
+static int new_subwin(lua_State* L, int derived)
+{
+    int h, w, y, x;
+    WINDOW* parent;
+    WINDOW* win;
+
+    parent = check_window(L, 1)->win;
+    h = luaL_checkint(L, 2);
+    w = luaL_checkint(L, 3);
+    y = luaL_optint(L, 4, 0);
+    x = luaL_optint(L, 5, 0);
+
+    if (derived) {
+        win = derwin(parent, h, w, y, x);
+    }
+    else {
+        win = subwin(parent, h, w, y, x);
+    }
+    if (win == NULL) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    push_window(L, win, 1, 1);
+    return 1;
+}
+
+static int l_subwin(lua_State* L)
+{
+    return new_subwin(L, 0);
+}
+
+static int l_derwin(lua_State* L)
+{
+    return new_subwin(L, 1);
+}
+
+/* delwin fails for a window which still has subwindows, which leaves it
+ * usable (and it's still deleted when it's collected) */
+static int l_delwin(lua_State* L)
+{
+    window* w;
+    int ret = OK;
+
+    w = check_window(L, 1);
+    if (w->owned && w->win != NULL) {
+        ret = delwin(w->win);
+    }
+    if (ret == OK) {
+        w->win = NULL;
+    }
+
+    lua_pushboolean(L, ret == OK);
+    return 1;
+}
+
+static int l_mvwin(lua_State* L)
+{
+    WINDOW* win;
+    int y, x;
+
+    win = check_window(L, 1)->win;
+    y = luaL_checkint(L, 2);
+    x = luaL_checkint(L, 3);
+
+    lua_pushboolean(L, mvwin(win, y, x) == OK);
+    return 1;
+}
+
+/* resize(win, h, w) changes the size of a window or pad, keeping what is in
+ * it. subwindows aren't resized along with their parents */
+static int l_resize(lua_State* L)
+{
+    window* w;
+    int h, width;
+
+    w = check_window(L, 1);
+    h = luaL_checkint(L, 2);
+    width = luaL_checkint(L, 3);
+
+    lua_pushboolean(L, wresize(w->win, h, width) == OK);
+    w->view_moved = 1;
+    return 1;
+}
+
+/* resizeterm(lines, cols) resizes stdscr and curscr along with every other
+ * window which would otherwise extend past the new size. ncurses does this
+ * itself when it catches SIGWINCH, and then getch returns "resize" */
+static int l_resizeterm(lua_State* L)
+{
+    int lines, cols;
+
+    lines = luaL_checkint(L, 1);
+    cols = luaL_checkint(L, 2);
+
+    lua_pushboolean(L, resizeterm(lines, cols) == OK);
+    return 1;
+}
+
+static int l_is_term_resized(lua_State* L)
+{
+    int lines, cols;
+
+    lines = luaL_checkint(L, 1);
+    cols = luaL_checkint(L, 2);
+
+    lua_pushboolean(L, is_term_resized(lines, cols));
+    return 1;
+}
+
+static int l_touch(lua_State* L)
+{
+    int arg = 1;
+    WINDOW* win;
+
+    win = get_window(L, &arg);
+
+    lua_pushboolean(L, touchwin(win) == OK);
+    return 1;
+}
+
+/* pads can't be refreshed with wrefresh, so they use the viewport that was
+ * last given to prefresh instead */
+static int refresh_window(window* w, int batch)
+{
+    int ret;
+
+    if (!w->is_pad) {
+        ret = wnoutrefresh(w->win);
+    }
+    else {
+        ret = pnoutrefresh(w->win, w->view[0], w->view[1], w->view[2],
+                           w->view[3], w->view[4], w->view[5]);
+        w->view_moved = 0;
+    }
+
+    /* this is all wrefresh and prefresh do, but going through update_screen
+     * means the output can be counted and coalesced */
+    if (!batch && ret == OK) {
+        ret = update_screen();
+    }
+
+    return ret;
+}
+
+static int l_refresh(lua_State* L)
+{
+    window* w;
+
+    w = to_window(L, 1);
+    if (w == NULL) {
+        lua_pushboolean(L, wnoutrefresh(stdscr) == OK &&
+                           update_screen() == OK);
+    }
+    else {
+        lua_pushboolean(L, refresh_window(check_window(L, 1), 0) == OK);
+    }
+
+    return 1;
+}
+
+static int l_noutrefresh(lua_State* L)
+{
+    window* w;
+
+    w = to_window(L, 1);
+    if (w == NULL) {
+        lua_pushboolean(L, wnoutrefresh(stdscr) == OK);
+    }
+    else {
+        lua_pushboolean(L, refresh_window(check_window(L, 1), 1) == OK);
+    }
+
+    return 1;
+}
+
+/* copy each of the given windows to the virtual screen, skipping the ones
+ * which haven't changed since they were last refreshed, and then update the
+ * terminal once for all of them */
+static int l_commit(lua_State* L)
+{
+    int i, n, ret = OK;
+
+    n = lua_gettop(L);
+    for (i = 1; i <= n; ++i) {
+        window* w;
+
+        w = check_window(L, i);
+        if (is_wintouched(w->win) || w->view_moved) {
+            if (refresh_window(w, 1) != OK) {
+                ret = ERR;
+            }
+        }
+    }
+
+    if (update_screen() != OK) {
+        ret = ERR;
+    }
+
+    lua_pushboolean(L, ret == OK);
+    return 1;
+}
+
+static int l_doupdate(lua_State* L)
+{
+    lua_pushboolean(L, update_screen() == OK);
+    return 1;
+}
+
+/* sends any update which was put off in async mode, and waits for all output
+ * to reach the terminal */
+static int l_flush(lua_State* L)
+{
+    double blocked;
+
+    flush_deferred();
+    if (cur_screen->output != NULL) {
+        blocked = begin_blocking();
+        output_wait(cur_screen->output);
+        end_blocking(blocked);
+    }
+
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+/* returns how many seconds are left until an update which was put off can
+ * go out, or nil if there isn't one, so that a loop waiting on something
+ * other than getch knows how long it can wait for. doupdate sends it. while
+ * the last frame is still on its way to the terminal in async mode, there's
+ * no telling when that will be, so this just says to check back shortly */
+static int l_update_pending(lua_State* L)
+{
+    screen* scr = cur_screen;
+    double left = 0;
+
+    if (!scr->frame_deferred) {
+        lua_pushnil(L);
+        return 1;
+    }
+
+    if (scr->update_interval > 0) {
+        left = scr->last_update + scr->update_interval - now();
+    }
+    if (left <= 0 && scr->output != NULL && output_is_async(scr->output) &&
+        output_busy(scr->output)) {
+        left = 0.005;
+    }
+
+    lua_pushnumber(L, left > 0 ? left : 0);
+    return 1;
+}
+
+static int l_strwidth(lua_State* L)
+{
+    const char* str;
+    size_t len;
+
+    str = luaL_checklstring(L, 1, &len);
+
+    lua_pushinteger(L, str_width(str, len));
+    return 1;
+}
+
+/* style(table [, pin]) compiles a style table into an attribute. its pair
+ * is pinned (see free_pair) unless pin is false, in which case the result is
+ * only good until the pair is evicted, as with style tables passed directly */
+static int l_style(lua_State* L)
+{
+    chtype style;
+
+    luaL_checktype(L, 1, LUA_TTABLE);
+    style = get_char_attr(L, 1);
+    if (lua_isnoneornil(L, 2) || lua_toboolean(L, 2)) {
+        pin_dyn_pair(&cur_screen->dyn, PAIR_NUMBER(style));
+    }
+
+    lua_pushnumber(L, style);
+    return 1;
+}
+
+static int l_colors(lua_State* L)
+{
+    lua_pushinteger(L, COLORS);
+    return 1;
+}
+
+static int l_color_pairs(lua_State* L)
+{
+    lua_pushinteger(L, COLOR_PAIRS);
+    return 1;
+}
+
+/* pads: windows which can be larger than the screen, and are shown through a
+ * viewport. moving the viewport doesn't require redrawing the pad contents,
+ * so scrolling costs the same no matter how large the pad is */
+static window* check_pad(lua_State* L, int stack_pos)
+{
+    window* w;
+
+    w = check_window(L, stack_pos);
+    if (!w->is_pad) {
+        luaL_argerror(L, stack_pos, "pad expected");
+    }
+
+    return w;
+}
+
+static void init_pad_view(window* w)
+{
+    int h, x;
+
+    getmaxyx(w->win, h, x);
+
+    w->is_pad = 1;
+    w->view[0] = 0;
+    w->view[1] = 0;
+    w->view[2] = 0;
+    w->view[3] = 0;
+    w->view[4] = (h < LINES ? h : LINES) - 1;
+    w->view[5] = (x < COLS ? x : COLS) - 1;
+    w->view_moved = 1;
+}
+
+static int l_newpad(lua_State* L)
+{
+    int h, w;
+    WINDOW* win;
+
+    h = luaL_checkint(L, 1);
+    w = luaL_checkint(L, 2);
+
+    win = newpad(h, w);
+    if (win == NULL) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    init_pad_view(push_window(L, win, 1, 0));
+    return 1;
+}
+
+static int l_subpad(lua_State* L)
+{
+    int h, w, y, x;
+    WINDOW* win;
+
+    win = check_pad(L, 1)->win;
+    h = luaL_checkint(L, 2);
+    w = luaL_checkint(L, 3);
+    y = luaL_optint(L, 4, 0);
+    x = luaL_optint(L, 5, 0);
+
+    win = subpad(win, h, w, y, x);
+    if (win == NULL) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    init_pad_view(push_window(L, win, 1, 1));
+    return 1;
+}
+
+/* any viewport coordinates which are given replace the stored ones, so
+ * scrolling only needs pad:prefresh(row) */
+static void get_pad_view(lua_State* L, window* w, int stack_pos)
+{
+    int i;
+
+    for (i = 0; i < 6; ++i) {
+        if (lua_isnumber(L, stack_pos + i)) {
+            int val;
+
+            val = lua_tointeger(L, stack_pos + i);
+            if (val != w->view[i]) {
+                w->view[i] = val;
+                w->view_moved = 1;
+            }
+        }
+    }
+}
+
+static int l_prefresh(lua_State* L)
+{
+    window* w;
+
+    w = check_pad(L, 1);
+    get_pad_view(L, w, 2);
+
+    lua_pushboolean(L, refresh_window(w, 0) == OK);
+    return 1;
+}
+
+static int l_pnoutrefresh(lua_State* L)
+{
+    window* w;
+
+    w = check_pad(L, 1);
+    get_pad_view(L, w, 2);
+
+    lua_pushboolean(L, refresh_window(w, 1) == OK);
+    return 1;
+}
+
+/* screen dumps. scr_dump saves what is on the terminal, and scr_restore
+ * loads a dump into the virtual screen, to be drawn by the next update. this
+ * makes it possible to paint the last frame of the previous session straight
+ * away at startup, while the real one is being put together. scr_init tells
+ * ncurses that the terminal is already showing the dump (so that it can
+ * avoid redrawing it), and scr_set does both */
+static int l_scr_dump(lua_State* L)
+{
+    const char* filename;
+
+    filename = luaL_checkstring(L, 1);
+    flush_deferred();
+
+    lua_pushboolean(L, scr_dump(filename) == OK);
+    return 1;
+}
+
+static int l_scr_restore(lua_State* L)
+{
+    lua_pushboolean(L, scr_restore(luaL_checkstring(L, 1)) == OK);
+    return 1;
+}
+
+static int l_scr_init(lua_State* L)
+{
+    lua_pushboolean(L, scr_init(luaL_checkstring(L, 1)) == OK);
+    return 1;
+}
+
+static int l_scr_set(lua_State* L)
+{
+    lua_pushboolean(L, scr_set(luaL_checkstring(L, 1)) == OK);
+    return 1;
+}
+
+/* putwin(win, filename) and getwin(filename) save and load single windows */
+static int l_putwin(lua_State* L)
+{
+    WINDOW* win;
+    const char* filename;
+    FILE* fp;
+    int ret;
+
+    win = check_window(L, 1)->win;
+    filename = luaL_checkstring(L, 2);
+
+    fp = fopen(filename, "w");
+    if (fp == NULL) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+    ret = putwin(win, fp);
+    if (fclose(fp) != 0) {
+        ret = ERR;
+    }
+
+    lua_pushboolean(L, ret == OK);
+    return 1;
+}
+
+static WINDOW* read_window(const char* filename)
+{
+    WINDOW* win;
+    FILE* fp;
+
+    fp = fopen(filename, "r");
+    if (fp == NULL) {
+        return NULL;
+    }
+    win = getwin(fp);
+    fclose(fp);
+
+    return win;
+}
+
+static int l_getwin(lua_State* L)
+{
+    WINDOW* win;
+    window* w;
+
+    win = read_window(luaL_checkstring(L, 1));
+    if (win == NULL) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    w = push_window(L, win, 1, 0);
+    if (is_pad(win)) {
+        init_pad_view(w);
+    }
+    return 1;
+}
+
+static int l_window_gc(lua_State* L)
+{
+    window* w;
+
+    w = (window*)luaL_checkudata(L, 1, WINDOW_TABLE);
+    if (w->owned && w->win != NULL) {
+        delwin(w->win);
+    }
+    w->win = NULL;
+
+    return 0;
+}
+
+/* cell buffers: a packed array of chtypes which can be filled from lua in
+ * bulk, and then pushed to the screen a row at a time with addchnstr */
+static int get_cell_pos(lua_State* L, int stack_pos, pos* p)
+{
+    p->x = 0;
+    p->y = 0;
+
+    if (!lua_istable(L, stack_pos)) {
+        return 0;
+    }
+
+    lua_getfield(L, stack_pos, "x");
+    if (lua_isnumber(L, -1)) {
+        p->x = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    lua_getfield(L, stack_pos, "y");
+    if (lua_isnumber(L, -1)) {
+        p->y = lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+
+    return 1;
+}
+
+static cellbuf* check_cellbuf(lua_State* L, int stack_pos)
+{
+    return (cellbuf*)luaL_checkudata(L, stack_pos, CELLBUF_TABLE);
+}
+
+/* cells are plain chtypes, which can't hold wide characters, so only ascii
+ * characters (and the acs names) can be stored in them */
+static chtype get_cell_char(lua_State* L, int stack_pos, const char* str)
+{
+    luaL_argcheck(L, !((unsigned char)str[0] & 0x80), stack_pos,
+                  "cellbufs can only hold ascii characters");
+
+    return get_char_enum(str);
+}
+
+static void fill_cells(chtype* cells, int n, chtype ch)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        cells[i] = ch;
+    }
+}
+
+static cellbuf* new_cellbuf(lua_State* L, int w, int h)
+{
+    cellbuf* cb;
+    size_t ncells;
+
+    /* the cells live in the same allocation, directly after the header. the
+     * extra cell is for the terminator winchnstr writes after the last row */
+    ncells = (size_t)w * h + 1;
+    if (ncells > ((size_t)-1 - sizeof(cellbuf)) / sizeof(chtype)) {
+        luaL_error(L, "cellbuf is too large");
+    }
+    cb = lua_newuserdata(L, sizeof(cellbuf) + ncells * sizeof(chtype));
+    cb->w = w;
+    cb->h = h;
+    cb->cells = (chtype*)(cb + 1);
+    fill_cells(cb->cells, ncells, ' ');
+
+    luaL_getmetatable(L, CELLBUF_TABLE);
+    lua_setmetatable(L, -2);
+
+    return cb;
+}
+
+static int l_cellbuf(lua_State* L)
+{
+    int w, h;
+
+    w = luaL_checkint(L, 1);
+    h = luaL_checkint(L, 2);
+    luaL_argcheck(L, w > 0, 1, "width must be positive");
+    luaL_argcheck(L, h > 0, 2, "height must be positive");
+    /* the cells are indexed with ints, so there can't be more than that */
+    luaL_argcheck(L, w <= (INT_MAX - 1) / h, 1, "cellbuf is too large");
+
+    new_cellbuf(L, w, h);
+
+    return 1;
+}
+
+static int l_cellbuf_size(lua_State* L)
+{
+    cellbuf* cb;
+
+    cb = check_cellbuf(L, 1);
+
+    lua_pushnumber(L, cb->h);
+    lua_pushnumber(L, cb->w);
+    return 2;
+}
+
+static int l_cellbuf_fill(lua_State* L)
+{
+    cellbuf* cb;
+    chtype ch;
+
+    cb = check_cellbuf(L, 1);
+    ch = get_cell_char(L, 2, luaL_optlstring(L, 2, " ", NULL));
+    ch |= get_style(L, 3);
+
+    fill_cells(cb->cells, cb->w * cb->h, ch);
+
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+static int l_cellbuf_set(lua_State* L)
+{
+    cellbuf* cb;
+    pos p;
+    chtype ch;
+    int n;
+
+    cb = check_cellbuf(L, 1);
+    get_cell_pos(L, 2, &p);
+    ch = get_cell_char(L, 3, luaL_checklstring(L, 3, NULL));
+    n = luaL_optint(L, 4, 1);
+    ch |= get_style(L, 5);
+
+    if (p.y < 0 || p.y >= cb->h || p.x < 0 || p.x >= cb->w) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    /* runs are clipped to the end of the row */
+    if (n > cb->w - p.x) {
+        n = cb->w - p.x;
+    }
+    if (n > 0) {
+        fill_cells(cb->cells + p.y * cb->w + p.x, n, ch);
+    }
+
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+/* returns the character and style of a single cell */
+static int l_cellbuf_get(lua_State* L)
+{
+    cellbuf* cb;
+    pos p;
+    chtype ch;
+    char c;
+
+    cb = check_cellbuf(L, 1);
+    get_cell_pos(L, 2, &p);
+
+    if (p.y < 0 || p.y >= cb->h || p.x < 0 || p.x >= cb->w) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    ch = cb->cells[p.y * cb->w + p.x];
+    c = ch & A_CHARTEXT;
+    lua_pushlstring(L, &c, 1);
+    lua_pushnumber(L, ch & ~A_CHARTEXT);
+    return 2;
+}
+
+static int l_cellbuf_put(lua_State* L)
+{
+    cellbuf* cb;
+    pos p;
+    const char* str;
+    size_t len, i;
+    chtype attr;
+    chtype* row;
+
+    cb = check_cellbuf(L, 1);
+    get_cell_pos(L, 2, &p);
+    str = luaL_checklstring(L, 3, &len);
+    luaL_argcheck(L, is_ascii(str, len), 3,
+                  "cellbufs can only hold ascii characters");
+    attr = get_style(L, 4);
+
+    if (p.y < 0 || p.y >= cb->h || p.x < 0 || p.x >= cb->w) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    /* like runs, strings are clipped to the end of the row */
+    if (len > (size_t)(cb->w - p.x)) {
+        len = cb->w - p.x;
+    }
+    row = cb->cells + p.y * cb->w + p.x;
+    for (i = 0; i < len; ++i) {
+        row[i] = (unsigned char)str[i] | attr;
+    }
+
+    lua_pushboolean(L, TRUE);
+    return 1;
+}
+
+static int l_cellbuf_blit(lua_State* L)
+{
+    cellbuf* cb;
+    pos p;
+    WINDOW* win;
+    int row, maxy, maxx, ret = OK, arg = 2;
+
+    cb = check_cellbuf(L, 1);
+    win = get_window(L, &arg);
+    if (!get_cell_pos(L, arg, &p)) {
+        getyx(win, p.y, p.x);
+    }
+    getmaxyx(win, maxy, maxx);
+    (void)maxx;
+
+    for (row = 0; row < cb->h && p.y + row < maxy; ++row) {
+        if (mvwaddchnstr(win, p.y + row, p.x, cb->cells + row * cb->w,
+                         cb->w) != OK) {
+            ret = ERR;
+        }
+    }
+
+    lua_pushboolean(L, ret == OK);
+    return 1;
+}
+
+/* screen readback. a rectangle is given as a table with any of y, x, h and w,
+ * which default to the whole window; it is clipped to the window */
+typedef struct _rect {
+    int y;
+    int x;
+    int h;
+    int w;
+} rect;
+
+static int get_rect_field(lua_State* L, int stack_pos, const char* name,
+                          int def)
+{
+    int ret = def;
+
+    lua_getfield(L, stack_pos, name);
+    if (lua_isnumber(L, -1)) {
+        ret = lua_tointeger(L, -1);
+    }
+    lua_pop(L, 1);
+
+    return ret;
+}
+
+/* clips the rectangle to the window. the size can be left as INT_MAX to run
+ * to the edge of the window */
+static void clip_rect(WINDOW* win, rect* r)
+{
+    int maxy, maxx;
+
+    getmaxyx(win, maxy, maxx);
+    if (r->y < 0) {
+        r->h += r->y;
+        r->y = 0;
+    }
+    if (r->x < 0) {
+        r->w += r->x;
+        r->x = 0;
+    }
+    if (r->h > maxy - r->y) {
+        r->h = maxy - r->y;
+    }
+    if (r->w > maxx - r->x) {
+        r->w = maxx - r->x;
+    }
+}
+
+static int get_rect(lua_State* L, WINDOW* win, int* stack_pos, rect* r)
+{
+    int maxy, maxx, is_rect;
+
+    getmaxyx(win, maxy, maxx);
+    r->y = 0;
+    r->x = 0;
+    r->h = maxy;
+    r->w = maxx;
+
+    is_rect = lua_istable(L, *stack_pos);
+    if (is_rect) {
+        r->y = get_rect_field(L, *stack_pos, "y", 0);
+        r->x = get_rect_field(L, *stack_pos, "x", 0);
+        r->h = get_rect_field(L, *stack_pos, "h", maxy - r->y);
+        r->w = get_rect_field(L, *stack_pos, "w", maxx - r->x);
+        (*stack_pos)++;
+    }
+
+    clip_rect(win, r);
+
+    return is_rect;
+}
+
+/* the length of the longest prefix of a row read back with winnstr which
+ * fits into w columns */
+static size_t clip_row(const char* str, size_t len, int w)
+{
+    size_t i = 0;
+
+    if (is_ascii(str, len)) {
+        return len < (size_t)w ? len : (size_t)w;
+    }
+
+    while (i < len) {
+        wchar_t wc;
+        size_t n;
+        int cw;
+
+        n = decode_utf8((const unsigned char*)str + i, len - i, &wc);
+        cw = char_width(wc);
+        if (cw > w) {
+            break;
+        }
+        w -= cw;
+        i += n;
+    }
+
+    return i;
+}
+
+/* instr([win,] [rect]) returns the text in the rectangle, one line per row.
+ * the cursor is left where it was */
+static int l_instr(lua_State* L)
+{
+    int arg = 1, row, cury, curx, maxy, maxx, bufsize;
+    WINDOW* win;
+    rect r;
+    char* buf;
+    luaL_Buffer b;
+
+    win = get_window(L, &arg);
+    get_rect(L, win, &arg, &r);
+    getyx(win, cury, curx);
+    getmaxyx(win, maxy, maxx);
+    (void)maxy;
+
+    /* winnstr reads up to the end of the line, and counts its limit in
+     * bytes, so it needs room for every character left on the line */
+    bufsize = (maxx - r.x) * MB_CUR_MAX + 1;
+    buf = lua_newuserdata(L, bufsize > 1 ? bufsize : 2);
+
+    luaL_buffinit(L, &b);
+    for (row = 0; row < r.h && r.w > 0; ++row) {
+        int len;
+
+        len = mvwinnstr(win, r.y + row, r.x, buf, bufsize - 1);
+        if (len == ERR) {
+            len = 0;
+        }
+        if (row > 0) {
+            luaL_addchar(&b, '\n');
+        }
+        luaL_addlstring(&b, buf, clip_row(buf, len, r.w));
+    }
+    wmove(win, cury, curx);
+
+    luaL_pushresult(&b);
+    return 1;
+}
+
+/* inchstr([win,] [rect] [, cellbuf]) reads the characters and attributes in
+ * the rectangle into a cellbuf, one row per call, returning the cellbuf. if a
+ * cellbuf is given, the rectangle is clipped to its size (and defaults to
+ * it), otherwise a new one is created which fits the rectangle */
+static int l_inchstr(lua_State* L)
+{
+    int arg = 1, row, cury, curx, ret = OK;
+    WINDOW* win;
+    rect r;
+    cellbuf* cb;
+
+    win = get_window(L, &arg);
+    get_rect(L, win, &arg, &r);
+    if (lua_isnoneornil(L, arg)) {
+        if (r.h <= 0 || r.w <= 0) {
+            lua_pushboolean(L, FALSE);
+            return 1;
+        }
+        cb = new_cellbuf(L, r.w, r.h);
+    }
+    else {
+        cb = check_cellbuf(L, arg);
+        lua_pushvalue(L, arg);
+    }
+    if (r.h > cb->h) {
+        r.h = cb->h;
+    }
+    if (r.w > cb->w) {
+        r.w = cb->w;
+    }
+
+    getyx(win, cury, curx);
+    for (row = 0; row < r.h && r.w > 0; ++row) {
+        chtype* cells;
+        chtype after;
+
+        /* this writes a terminator after the row, which would clobber the
+         * cell following it (the spare cell, for the last row) */
+        cells = cb->cells + row * cb->w;
+        after = cells[r.w];
+        if (mvwinchnstr(win, r.y + row, r.x, cells, r.w) == ERR) {
+            ret = ERR;
+        }
+        cells[r.w] = after;
+    }
+    wmove(win, cury, curx);
+
+    if (ret != OK) {
+        lua_pop(L, 1);
+        lua_pushboolean(L, FALSE);
+    }
+    return 1;
+}
+
+/* rectangle operations. fill and clear_rect draw one horizontal line per row,
+ * and don't move the cursor */
+static int fill_rect(WINDOW* win, rect* r, const char* str, size_t len,
+                     chtype style)
+{
+    int row, wide, ret = OK;
+    cchar_t cc;
+    chtype ch = 0;
+
+    wide = (unsigned char)str[0] & 0x80;
+    if (wide) {
+        get_wide_char(&cc, str, len, style);
+    }
+    else {
+        ch = get_char_enum(str) | style;
+    }
+
+    for (row = 0; row < r->h && r->w > 0; ++row) {
+        if (wide) {
+            if (mvwhline_set(win, r->y + row, r->x, &cc, r->w) == ERR) {
+                ret = ERR;
+            }
+        }
+        else {
+            if (mvwhline(win, r->y + row, r->x, ch, r->w) == ERR) {
+                ret = ERR;
+            }
+        }
+    }
+
+    return ret;
+}
+
+/* fill([win,] [rect,] ch [, style]) */
+static int l_fill(lua_State* L)
+{
+    int arg = 1, cury, curx, ret;
+    WINDOW* win;
+    rect r;
+    const char* str;
+    size_t len;
+
+    win = get_window(L, &arg);
+    get_rect(L, win, &arg, &r);
+    str = luaL_checklstring(L, arg, &len);
+    if (len == 0) {
+        return luaL_argerror(L, arg, "empty fill string");
+    }
+
+    getyx(win, cury, curx);
+    ret = fill_rect(win, &r, str, len, get_style(L, arg + 1));
+    wmove(win, cury, curx);
+
+    lua_pushboolean(L, ret == OK);
+    return 1;
+}
+
+/* clear_rect([win,] [rect]) blanks the rectangle with the window background,
+ * the way erase does for the whole window */
+static int l_clear_rect(lua_State* L)
+{
+    int arg = 1, row, cury, curx, ret = OK;
+    WINDOW* win;
+    rect r;
+    chtype blank;
+
+    win = get_window(L, &arg);
+    get_rect(L, win, &arg, &r);
+    /* hline draws a line for a null character, which is what the
+     * background is until bkgd is called */
+    blank = getbkgd(win);
+    if ((blank & A_CHARTEXT) == 0) {
+        blank |= ' ';
+    }
+
+    getyx(win, cury, curx);
+    for (row = 0; row < r.h && r.w > 0; ++row) {
+        if (mvwhline(win, r.y + row, r.x, blank, r.w) == ERR) {
+            ret = ERR;
+        }
+    }
+    wmove(win, cury, curx);
+
+    lua_pushboolean(L, ret == OK);
+    return 1;
+}
+
+/* whether the word starting at start fits on a line of its own */
+static int word_fits(const char* str, size_t len, size_t start, int w)
+{
+    int cur_w = 0, chw;
+
+    while (start < len && str[start] != ' ' && str[start] != '\n') {
+        start += measure_char(str + start, len - start, &chw);
+        cur_w += chw;
+        if (cur_w > w) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* text layout. measure_line finds the line of text starting at start which
+ * fits into w columns: it runs up to *end, is *width columns wide, and the
+ * line after it starts at *next. when wrapping, lines are broken at spaces
+ * where possible, and in the middle of a word otherwise. without wrapping,
+ * each line of the text is cut off at w columns. returns whether the line
+ * had to be cut short */
+static int measure_line(const char* str, size_t len, size_t start, int w,
+                        int wrap, size_t* end, size_t* next, int* width)
+{
+    size_t i = start, brk = start, lead = start, n = 0;
+    int cur_w = 0, brk_w = 0, chw = 0, cut = 0;
+
+    /* the end of the indentation is a break point too, if the word after it
+     * fits on a line of its own */
+    while (lead < len && str[lead] == ' ') {
+        lead++;
+    }
+
+    while (i < len && str[i] != '\n') {
+        n = measure_char(str + i, len - i, &chw);
+        if (str[i] == ' ' && (i == start || str[i - 1] != ' ')) {
+            brk = i;
+            brk_w = cur_w;
+        }
+        if (cur_w + chw > w) {
+            cut = 1;
+            break;
+        }
+        cur_w += chw;
+        i += n;
+    }
+
+    if (!cut || !wrap) {
+        *end = i;
+        *width = cur_w;
+        while (i < len && str[i] != '\n') {
+            i++;
+        }
+        *next = i < len ? i + 1 : len;
+    }
+    else {
+        if (brk > start) {
+            *end = brk;
+            *width = brk_w;
+            i = brk;
+        }
+        else if (lead > start && lead <= i && word_fits(str, len, lead, w)) {
+            /* the indentation is kept, rather than trimmed away below */
+            *end = lead;
+            *width = (int)(lead - start);
+            *next = lead;
+            return cut;
+        }
+        else if (i == start) {
+            /* a character wider than the line still has to go somewhere */
+            *end = i + n;
+            *width = chw;
+            i += n;
+        }
+        else {
+            *end = i;
+            *width = cur_w;
+        }
+
+        /* the spaces a line was broken at aren't carried over */
+        while (i < len && str[i] == ' ') {
+            i++;
+        }
+        if (i < len && str[i] == '\n') {
+            i++;
+        }
+        *next = i;
+    }
+
+    while (*end > start && str[*end - 1] == ' ') {
+        (*end)--;
+        (*width)--;
+    }
+
+    return cut;
+}
+
+enum {
+    ALIGN_LEFT,
+    ALIGN_CENTER,
+    ALIGN_RIGHT
+};
+
+/* addtext([win,] [rect,] str [, opts]) lays the text out in the rectangle,
+ * a line per row, without moving the cursor. opts may have:
+ *   wrap: whether to word wrap lines which are too long (default true)
+ *   align: "left" (the default), "center" or "right"
+ *   ellipsis: drawn at the end of the last line when the text doesn't fit
+ *             ("..." by default, or false for none)
+ *   style: the style to draw the text in
+ * returns the number of lines used */
+static int l_addtext(lua_State* L)
+{
+    int arg = 1, wrap = 1, align = ALIGN_LEFT, set_attrs = 0;
+    int row = 0, cury, curx, ell_w = 0;
+    WINDOW* win;
+    rect r;
+    const char* str;
+    const char* ell = "...";
+    size_t len, ell_len = 3, start = 0;
+    attr_t old_mode = 0;
+    short old_color = 0;
+
+    win = get_window(L, &arg);
+    get_rect(L, win, &arg, &r);
+    str = luaL_checklstring(L, arg, &len);
+
+    if (lua_istable(L, arg + 1)) {
+        lua_getfield(L, arg + 1, "wrap");
+        if (!lua_isnil(L, -1)) {
+            wrap = lua_toboolean(L, -1);
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, arg + 1, "align");
+        if (lua_isstring(L, -1)) {
+            const char* name = lua_tostring(L, -1);
+
+            if (!strcmp(name, "center")) {
+                align = ALIGN_CENTER;
+            }
+            else if (!strcmp(name, "right")) {
+                align = ALIGN_RIGHT;
+            }
+        }
+        lua_pop(L, 1);
+
+        /* the string stays referenced by opts while we use it */
+        lua_getfield(L, arg + 1, "ellipsis");
+        if (lua_isstring(L, -1)) {
+            ell = lua_tolstring(L, -1, &ell_len);
+        }
+        else if (!lua_isnil(L, -1) && !lua_toboolean(L, -1)) {
+            ell = NULL;
+        }
+        lua_pop(L, 1);
+
+        lua_getfield(L, arg + 1, "style");
+        if (is_style(L, -1)) {
+            chtype style = get_style(L, -1);
+
+            set_attrs = 1;
+            wattr_get(win, &old_mode, &old_color, NULL);
+            wattr_set(win, style & A_ATTRIBUTES & ~A_COLOR,
+                      PAIR_NUMBER(style), NULL);
+        }
+        lua_pop(L, 1);
+    }
+    if (ell != NULL) {
+        ell_w = str_width(ell, ell_len);
+        if (ell_w > r.w) {
+            ell = NULL;
+        }
+    }
+
+    getyx(win, cury, curx);
+    while (row < r.h && r.w > 0 && start < len) {
+        size_t end, next;
+        int width, cut, use_ell;
+        pos p;
+
+        cut = measure_line(str, len, start, r.w, wrap, &end, &next, &width);
+        use_ell = ell != NULL &&
+                  ((cut && !wrap) || (row == r.h - 1 && next < len));
+        if (use_ell) {
+            size_t unused;
+
+            measure_line(str, end, start, r.w - ell_w, 0, &end, &unused,
+                         &width);
+            width += ell_w;
+        }
+
+        p.y = r.y + row;
+        p.x = r.x;
+        if (align == ALIGN_CENTER) {
+            p.x += (r.w - width) / 2;
+        }
+        else if (align == ALIGN_RIGHT) {
+            p.x += r.w - width;
+        }
+        if (p.x < r.x) {
+            /* a single character wider than the rect */
+            p.x = r.x;
+        }
+
+        wmove(win, p.y, p.x);
+        add_str(win, NULL, str + start, end - start, 0, 0);
+        if (use_ell) {
+            add_str(win, NULL, ell, ell_len, 0, 0);
+        }
+
+        row++;
+        start = next;
+    }
+    wmove(win, cury, curx);
+
+    if (set_attrs) {
+        wattr_set(win, old_mode, old_color, NULL);
+    }
+
+    lua_pushinteger(L, row);
+    return 1;
+}
+
+/* copywin(src, dst, [rect,] [pos [, overlay]]) copies the rectangle of src
+ * to pos in dst (the top left corner by default), clipped to fit. if overlay
+ * is true, blanks in src don't overwrite dst */
+static int l_copywin(lua_State* L)
+{
+    int arg = 3, maxy, maxx, overlay;
+    WINDOW* src;
+    WINDOW* dst;
+    rect r;
+    pos p;
+
+    src = check_window(L, 1)->win;
+    dst = check_window(L, 2)->win;
+    get_rect(L, src, &arg, &r);
+    if (get_cell_pos(L, arg, &p)) {
+        arg++;
+    }
+    overlay = lua_toboolean(L, arg);
+
+    getmaxyx(dst, maxy, maxx);
+    if (r.h > maxy - p.y) {
+        r.h = maxy - p.y;
+    }
+    if (r.w > maxx - p.x) {
+        r.w = maxx - p.x;
+    }
+    if (p.y < 0 || p.x < 0 || r.h <= 0 || r.w <= 0) {
+        lua_pushboolean(L, FALSE);
+        return 1;
+    }
+
+    lua_pushboolean(L, copywin(src, dst, r.y, r.x, p.y, p.x, p.y + r.h - 1,
+                               p.x + r.w - 1, overlay) == OK);
+    return 1;
+}
+
+static int l_overlay(lua_State* L)
+{
+    lua_pushboolean(L, overlay(check_window(L, 1)->win,
+                               check_window(L, 2)->win) == OK);
+    return 1;
+}
+
+static int l_overwrite(lua_State* L)
+{
+    lua_pushboolean(L, overwrite(check_window(L, 1)->win,
+                                 check_window(L, 2)->win) == OK);
+    return 1;
+}
+
+/* bkgd([win,] [ch [, style]]) sets the background, and applies it to every
+ * cell of the window. bkgdset only sets it for cells cleared later */
+static int set_background(lua_State* L, int apply)
+{
+    int arg = 1;
+    WINDOW* win;
+    const char* str;
+    size_t len;
+    chtype style;
+
+    win = get_window(L, &arg);
+    str = luaL_optlstring(L, arg, " ", &len);
+    style = get_style(L, arg + 1);
+
+    if ((unsigned char)str[0] & 0x80) {
+        cchar_t cc;
+
+        get_wide_char(&cc, str, len, style);
+        if (apply) {
+            return wbkgrnd(win, &cc);
+        }
+        wbkgrndset(win, &cc);
+        return OK;
+    }
+
+    if (apply) {
+        return wbkgd(win, get_char_enum(str) | style);
+    }
+    wbkgdset(win, get_char_enum(str) | style);
+    return OK;
+}
+
+static int l_bkgd(lua_State* L)
+{
+    lua_pushboolean(L, set_background(L, 1) == OK);
+    return 1;
+}
+
+static int l_bkgdset(lua_State* L)
+{
+    lua_pushboolean(L, set_background(L, 0) == OK);
+    return 1;
+}
+
+/* display lists record drawing operations into a buffer on the c side, so
+ * that a frame (or a layer of one which doesn't change) can be built up once
+ * and then drawn with a single call. styles are resolved when the operation
+ * is recorded, and when the list is drawn the window's attributes are only
+ * changed when the style actually changes from one operation to the next.
+ * operations without a style use the window's own attributes, and rectangles
+ * are clipped to the window the list is drawn on. a list belongs to the
+ * screen it was made on, and pins the pairs of its styles there until it is
+ * cleared or collected */
+enum {
+    DL_MOVE,
+    DL_ADDSTR,
+    DL_ADDCH,
+    DL_FILL,
+    DL_BORDER
+};
 
-    /* figure out which foreground value to use */
-    lua_getfield(L, -1, "colors");
-    lua_getfield(L, -1, fg);
-    if (lua_isnil(L, -1)) {
-        return luaL_error(L, "init_pair: Trying to use a non-existant foreground color: \"%s\"", fg);
-    }
-    fg_val = lua_tointeger(L, -1);
-    lua_pop(L, 1);
+static drawlist* check_drawlist(lua_State* L, int stack_pos)
+{
+    return (drawlist*)luaL_checkudata(L, stack_pos, DRAWLIST_TABLE);
+}
 
-    /* and background value */
-    lua_getfield(L, -1, bg);
-    if (lua_isnil(L, -1)) {
-        return luaL_error(L, "init_pair: Trying to use a non-existant background color: \"%s\"", bg);
-    }
-    bg_val = lua_tointeger(L, -1);
-    lua_pop(L, 3);
+static int l_drawlist(lua_State* L)
+{
+    drawlist* dl;
 
-    if (name_val != 0) {
-        lua_pushboolean(L, (init_pair(name_val, fg_val, bg_val) == OK));
+    dl = lua_newuserdata(L, sizeof(drawlist));
+    memset(dl, 0, sizeof(drawlist));
+    dl->scr = cur_screen;
+
+    luaL_getmetatable(L, DRAWLIST_TABLE);
+    lua_setmetatable(L, -2);
+
+    /* keep a screen opened by newterm alive for as long as the list */
+    lua_getfield(L, LUA_REGISTRYINDEX, REG_TABLE);
+    lua_getfield(L, -1, "cur_screen");
+    if (!lua_isnil(L, -1)) {
+        lua_createtable(L, 0, 1);
+        lua_insert(L, -2);
+        lua_setfield(L, -2, "screen");
+        lua_setfenv(L, -3);
+        lua_pop(L, 1);
     }
     else {
-        lua_pushboolean(L, (assume_default_colors(fg_val, bg_val) == OK));
+        lua_pop(L, 2);
     }
+
     return 1;
 }
 
-static int l_getch(lua_State* L)
+/* drops the pins the list's styles hold, unless the pool they were taken in
+ * has gone since */
+static void unpin_ops(drawlist* dl)
 {
-    int c;
-    pos p;
-    const char* key_name;
+    dyn_pool* dp = &dl->scr->dyn;
+    int i;
 
-    if (get_pos(L, &p)) {
-        c = mvgetch(p.y, p.x);
+    for (i = 0; i < dl->nops; ++i) {
+        if (dl->ops[i].pin != 0 && dl->ops[i].pin == dp->generation) {
+            unpin_dyn_pair(dp, PAIR_NUMBER(dl->ops[i].style));
+        }
     }
-    else {
-        c = getch();
+}
+
+static int l_drawlist_gc(lua_State* L)
+{
+    drawlist* dl;
+
+    dl = check_drawlist(L, 1);
+    if (dl->scr != NULL) {
+        unpin_ops(dl);
     }
-    if (c == ERR) {
-        lua_pushboolean(L, 0);
-        return 1;
+    free(dl->ops);
+    free(dl->text);
+    memset(dl, 0, sizeof(drawlist));
+
+    return 0;
+}
+
+/* appends a new operation, with the style at style_pos if there is one, and
+ * the string at text_pos (if it isn't 0) copied into the text buffer. the
+ * copies are null terminated, since characters are looked up by name */
+static dl_op* push_op(lua_State* L, drawlist* dl, int type, int text_pos,
+                      int style_pos)
+{
+    dl_op* op;
+
+    if (dl->nops == dl->max_ops) {
+        int max_ops = dl->max_ops ? dl->max_ops * 2 : 32;
+        dl_op* ops;
+
+        ops = realloc(dl->ops, max_ops * sizeof(dl_op));
+        if (ops == NULL) {
+            luaL_error(L, "Unable to grow the display list");
+        }
+        dl->ops = ops;
+        dl->max_ops = max_ops;
     }
 
-    key_name = get_key_str(c);
+    op = &dl->ops[dl->nops];
+    memset(op, 0, sizeof(dl_op));
+    op->type = type;
 
-    if (key_name == NULL) {
-        char s;
+    if (text_pos != 0) {
+        const char* str;
+        size_t len;
 
-        s = c;
-        lua_pushlstring(L, &s, 1);
+        str = luaL_checklstring(L, text_pos, &len);
+        if (dl->text_len + len + 1 > dl->text_size) {
+            size_t text_size = dl->text_size ? dl->text_size : 1024;
+            char* text;
+
+            while (dl->text_len + len + 1 > text_size) {
+                text_size *= 2;
+            }
+            text = realloc(dl->text, text_size);
+            if (text == NULL) {
+                luaL_error(L, "Unable to grow the display list");
+            }
+            dl->text = text;
+            dl->text_size = text_size;
+        }
+        memcpy(dl->text + dl->text_len, str, len + 1);
+        op->text = dl->text_len;
+        op->len = len;
+        op->ascii = is_ascii(str, len);
+        dl->text_len += len + 1;
     }
-    else {
-        lua_pushstring(L, key_name);
+
+    if (style_pos != 0 && is_style(L, style_pos)) {
+        if (cur_screen != dl->scr) {
+            luaL_error(L, "The display list belongs to another screen");
+        }
+        op->has_style = 1;
+        op->style = get_style(L, style_pos);
+        if (pin_dyn_pair(&cur_screen->dyn, PAIR_NUMBER(op->style))) {
+            op->pin = cur_screen->dyn.generation;
+        }
     }
 
-    return 1;
+    /* only counted once everything which could fail has been done */
+    dl->nops++;
+    return op;
 }
 
-static int l_ungetch(lua_State* L)
+/* rectangles are recorded as they are given; the size defaults to running
+ * to the edge of the window the list is drawn on */
+static void get_dl_rect(lua_State* L, int stack_pos, dl_op* op)
 {
-    const char* ch_str;
-    int ch;
-
-    ch_str = luaL_checklstring(L, 1, NULL);
-    ch = get_key_enum(ch_str);
+    op->y = 0;
+    op->x = 0;
+    op->h = INT_MAX;
+    op->w = INT_MAX;
 
-    lua_pushboolean(L, ungetch(ch) == OK);
-    return 1;
+    if (lua_istable(L, stack_pos)) {
+        op->y = get_rect_field(L, stack_pos, "y", 0);
+        op->x = get_rect_field(L, stack_pos, "x", 0);
+        op->h = get_rect_field(L, stack_pos, "h", INT_MAX);
+        op->w = get_rect_field(L, stack_pos, "w", INT_MAX);
+    }
 }
 
-static int l_move(lua_State* L)
+static int l_drawlist_move(lua_State* L)
 {
+    drawlist* dl;
+    dl_op* op;
+    int arg = 2;
     pos p;
 
-    if (get_pos(L, &p)) {
-        lua_pushboolean(L, (move(p.y, p.x) == OK));
-    }
-    else {
-        int x, y;
-
-        y = luaL_checkint(L, 1);
-        x = luaL_checkint(L, 2);
-
-        lua_pushboolean(L, (move(y, x) == OK));
-    }
+    dl = check_drawlist(L, 1);
+    get_mv_pos(L, &arg, &p);
+    op = push_op(L, dl, DL_MOVE, 0, 0);
+    op->has_pos = 1;
+    op->y = p.y;
+    op->x = p.x;
 
-    return 1;
+    return 0;
 }
 
-static int l_addch(lua_State* L)
+/* addstr(str [, style]), mvaddstr(y, x, str [, style]), and the same for
+ * addch */
+static int record_add(lua_State* L, int type, int is_mv)
 {
-    int is_mv;
+    drawlist* dl;
+    dl_op* op;
+    int arg = 2;
     pos p;
-    chtype ch;
 
-    is_mv = get_pos(L, &p);
-    ch = get_char_enum(luaL_checklstring(L, 1, NULL));
-    if (lua_istable(L, 2)) {
-        ch |= get_char_attr(L, 2);
+    dl = check_drawlist(L, 1);
+    if (is_mv) {
+        get_mv_pos(L, &arg, &p);
     }
-
+    op = push_op(L, dl, type, arg, arg + 1);
     if (is_mv) {
-        lua_pushboolean(L, mvaddch(p.y, p.x, ch) == OK);
+        op->has_pos = 1;
+        op->y = p.y;
+        op->x = p.x;
     }
-    else {
-        lua_pushboolean(L, addch(ch) == OK);
+    if (type == DL_ADDCH && op->len > 0 && op->ascii) {
+        op->ch = get_char_enum(dl->text + op->text);
     }
 
-    return 1;
+    return 0;
 }
 
-static int l_echochar(lua_State* L)
+static int l_drawlist_addstr(lua_State* L)
 {
-    int is_mv;
-    pos p;
-    chtype ch;
+    return record_add(L, DL_ADDSTR, 0);
+}
 
-    is_mv = get_pos(L, &p);
-    ch = get_char_enum(luaL_checklstring(L, 1, NULL));
-    if (lua_istable(L, 2)) {
-        ch |= get_char_attr(L, 2);
-    }
+static int l_drawlist_mvaddstr(lua_State* L)
+{
+    return record_add(L, DL_ADDSTR, 1);
+}
 
-    if (is_mv) {
-        int ret;
+static int l_drawlist_addch(lua_State* L)
+{
+    return record_add(L, DL_ADDCH, 0);
+}
 
-        ret = move(p.y, p.x);
-        if (ret == OK) {
-            ret = echochar(ch);
-        }
+static int l_drawlist_mvaddch(lua_State* L)
+{
+    return record_add(L, DL_ADDCH, 1);
+}
 
-        lua_pushboolean(L, ret == OK);
+/* fill([rect,] ch [, style]) */
+static int l_drawlist_fill(lua_State* L)
+{
+    drawlist* dl;
+    dl_op* op;
+    int arg = 2;
+
+    dl = check_drawlist(L, 1);
+    if (lua_istable(L, arg)) {
+        arg++;
     }
-    else {
-        lua_pushboolean(L, echochar(ch) == OK);
+    if (lua_objlen(L, arg) == 0) {
+        luaL_checkstring(L, arg);
+        return luaL_argerror(L, arg, "empty fill string");
     }
+    op = push_op(L, dl, DL_FILL, arg, arg + 1);
+    get_dl_rect(L, 2, op);
 
-    return 1;
+    return 0;
 }
 
-static int l_addstr(lua_State* L)
+/* border([rect [, style]]) draws a box around the edge of the rectangle */
+static int l_drawlist_border(lua_State* L)
 {
-    int is_mv, set_attrs = 0;
-    pos p;
-    const char* str;
-    attr_t old_mode = 0;
-    short old_color = 0;
+    drawlist* dl;
+    dl_op* op;
 
-    is_mv = get_pos(L, &p);
-    str = luaL_checklstring(L, 1, NULL);
-    if (lua_istable(L, 2)) {
-        int new_mode, new_color;
+    dl = check_drawlist(L, 1);
+    op = push_op(L, dl, DL_BORDER, 0, 3);
+    get_dl_rect(L, 2, op);
 
-        set_attrs = 1;
-        attr_get(&old_mode, &old_color, NULL);
-        new_mode = get_char_attr(L, 2);
-        new_color = PAIR_NUMBER(new_mode);
-        new_mode &= A_ATTRIBUTES & ~A_COLOR;
-        attr_set(new_mode, new_color, NULL);
-    }
+    return 0;
+}
 
-    if (is_mv) {
-        lua_pushboolean(L, mvaddstr(p.y, p.x, str) == OK);
-    }
-    else {
-        lua_pushboolean(L, addstr(str) == OK);
-    }
+static int l_drawlist_clear(lua_State* L)
+{
+    drawlist* dl;
 
-    if (set_attrs) {
-        attr_set(old_mode, old_color, NULL);
-    }
+    dl = check_drawlist(L, 1);
+    unpin_ops(dl);
+    dl->nops = 0;
+    dl->text_len = 0;
+
+    return 0;
+}
+
+static int l_drawlist_size(lua_State* L)
+{
+    drawlist* dl;
+
+    dl = check_drawlist(L, 1);
+    lua_pushnumber(L, dl->nops);
 
     return 1;
 }
 
-static int l_delch(lua_State* L)
+static int draw_border(WINDOW* win, rect* r)
 {
-    pos p;
+    int ret = OK, bottom, right;
 
-    if (get_pos(L, &p)) {
-        lua_pushboolean(L, mvdelch(p.y, p.x) == OK);
+    if (r->h < 2 || r->w < 2) {
+        return ERR;
     }
-    else {
-        lua_pushboolean(L, delch() == OK);
+    bottom = r->y + r->h - 1;
+    right = r->x + r->w - 1;
+
+    /* the corners are drawn as lines of length one, since addch would
+     * scroll at the bottom right corner of the window */
+    if (mvwhline(win, r->y, r->x + 1, ACS_HLINE, r->w - 2) == ERR ||
+        mvwhline(win, bottom, r->x + 1, ACS_HLINE, r->w - 2) == ERR ||
+        mvwvline(win, r->y + 1, r->x, ACS_VLINE, r->h - 2) == ERR ||
+        mvwvline(win, r->y + 1, right, ACS_VLINE, r->h - 2) == ERR ||
+        mvwhline(win, r->y, r->x, ACS_ULCORNER, 1) == ERR ||
+        mvwhline(win, r->y, right, ACS_URCORNER, 1) == ERR ||
+        mvwhline(win, bottom, r->x, ACS_LLCORNER, 1) == ERR ||
+        mvwhline(win, bottom, right, ACS_LRCORNER, 1) == ERR) {
+        ret = ERR;
     }
 
-    return 1;
+    return ret;
 }
 
-static int l_insch(lua_State* L)
+static int draw_op(WINDOW* win, drawlist* dl, dl_op* op)
 {
-    int is_mv;
-    pos p;
-    chtype ch;
+    const char* str = dl->text + op->text;
+    int ret = ERR;
 
-    is_mv = get_pos(L, &p);
-    ch = get_char_enum(luaL_checklstring(L, 1, NULL));
-    if (lua_istable(L, 2)) {
-        ch |= get_char_attr(L, 2);
-    }
+    switch (op->type) {
+    case DL_MOVE:
+        ret = wmove(win, op->y, op->x);
+        break;
+    case DL_ADDSTR:
+        if (op->has_pos && wmove(win, op->y, op->x) == ERR) {
+            break;
+        }
+        if (op->ascii) {
+            ret = waddnstr(win, str, op->len);
+        }
+        else {
+            wchar_t* wstr;
+            int wlen;
 
-    if (is_mv) {
-        lua_pushboolean(L, mvinsch(p.y, p.x, ch) == OK);
+            wstr = decode_utf8_str(str, op->len, &wlen);
+            if (wstr != NULL) {
+                ret = waddnwstr(win, wstr, wlen);
+            }
+        }
+        break;
+    case DL_ADDCH:
+        if (op->has_pos && wmove(win, op->y, op->x) == ERR) {
+            break;
+        }
+        if (op->ascii) {
+            ret = waddch(win, op->ch);
+        }
+        else {
+            cchar_t cc;
+
+            get_wide_char(&cc, str, op->len, 0);
+            ret = wadd_wch(win, &cc);
+        }
+        break;
+    case DL_FILL:
+    case DL_BORDER: {
+        rect r;
+        int cury, curx;
+
+        r.y = op->y;
+        r.x = op->x;
+        r.h = op->h;
+        r.w = op->w;
+        clip_rect(win, &r);
+
+        getyx(win, cury, curx);
+        if (op->type == DL_FILL) {
+            ret = op->len > 0 ? fill_rect(win, &r, str, op->len, 0) : ERR;
+        }
+        else {
+            ret = draw_border(win, &r);
+        }
+        wmove(win, cury, curx);
+        break;
     }
-    else {
-        lua_pushboolean(L, insch(ch) == OK);
     }
 
-    return 1;
+    return ret;
 }
 
-static int l_insstr(lua_State* L)
+/* draw([win]) replays the list onto the window, returning whether every
+ * operation succeeded. it doesn't refresh */
+static int l_drawlist_draw(lua_State* L)
 {
-    int is_mv, set_attrs = 0;
-    pos p;
-    const char* str;
-    attr_t old_mode = 0;
-    short old_color = 0;
+    drawlist* dl;
+    WINDOW* win;
+    int i, arg = 2, ret = OK, in_style = 0;
+    attr_t old_mode;
+    short old_color;
+    chtype cur_style = 0;
 
-    is_mv = get_pos(L, &p);
-    str = luaL_checklstring(L, 1, NULL);
-    if (lua_istable(L, 2)) {
-        int new_mode, new_color;
+    dl = check_drawlist(L, 1);
+    win = get_window(L, &arg);
 
-        set_attrs = 1;
-        attr_get(&old_mode, &old_color, NULL);
-        new_mode = get_char_attr(L, 2);
-        new_color = PAIR_NUMBER(new_mode);
-        new_mode &= A_ATTRIBUTES & ~A_COLOR;
-        attr_set(new_mode, new_color, NULL);
-    }
+    wattr_get(win, &old_mode, &old_color, NULL);
+    for (i = 0; i < dl->nops; ++i) {
+        dl_op* op = &dl->ops[i];
 
-    if (is_mv) {
-        lua_pushboolean(L, mvinsstr(p.y, p.x, str) == OK);
+        if (op->type != DL_MOVE) {
+            if (op->has_style && (!in_style || op->style != cur_style)) {
+                wattr_set(win, op->style & A_ATTRIBUTES & ~A_COLOR,
+                          PAIR_NUMBER(op->style), NULL);
+                cur_style = op->style;
+                in_style = 1;
+            }
+            else if (!op->has_style && in_style) {
+                wattr_set(win, old_mode, old_color, NULL);
+                in_style = 0;
+            }
+        }
+
+        if (draw_op(win, dl, op) == ERR) {
+            ret = ERR;
+        }
     }
-    else {
-        lua_pushboolean(L, insstr(str) == OK);
+    if (in_style) {
+        wattr_set(win, old_mode, old_color, NULL);
     }
 
-    if (set_attrs) {
-        attr_set(old_mode, old_color, NULL);
+    lua_pushboolean(L, ret == OK);
+    return 1;
+}
+
+/* plain c entry points for the hot drawing and input functions, for use
+ * through the luajit ffi (see curses_ffi.lua), where calls through the lua
+ * api can't be compiled. styles are the numbers returned by curses.style, and
+ * a style of 0 keeps the window's attributes, as when addstr is called
+ * without a style. keys are returned as raw key codes */
+extern WINDOW* lnc_stdscr(void)
+{
+    return stdscr;
+}
+
+extern unsigned long lnc_char(const char* str)
+{
+    return get_char_enum(str);
+}
+
+extern int lnc_wmove(WINDOW* win, int y, int x)
+{
+    return wmove(win, y, x);
+}
+
+/* as with waddnstr, a negative n means the whole string */
+static size_t lnc_len(const char* str, int n)
+{
+    size_t len;
+
+    len = strlen(str);
+    if (n >= 0 && (size_t)n < len) {
+        len = n;
     }
 
-    return 1;
+    return len;
 }
 
-static int l_insdelln(lua_State* L)
+extern int lnc_waddnstr(WINDOW* win, const char* str, int n,
+                        unsigned long attr)
 {
-    int n;
+    return add_str(win, NULL, str, lnc_len(str, n), attr != 0, attr);
+}
 
-    n = luaL_checkint(L, 1);
+extern int lnc_mvwaddnstr(WINDOW* win, int y, int x, const char* str, int n,
+                          unsigned long attr)
+{
+    pos p;
 
-    lua_pushboolean(L, (insdelln(n) == OK));
-    return 1;
+    p.y = y;
+    p.x = x;
+    return add_str(win, &p, str, lnc_len(str, n), attr != 0, attr);
 }
 
-static int l_getmaxyx(lua_State* L)
+extern int lnc_mvaddnstr(int y, int x, const char* str, int n,
+                         unsigned long attr)
+{
+    return lnc_mvwaddnstr(stdscr, y, x, str, n, attr);
+}
+
+extern int lnc_mvwaddch(WINDOW* win, int y, int x, unsigned long ch)
 {
-    int x, y;
+    return mvwaddch(win, y, x, ch);
+}
 
-    getmaxyx(stdscr, y, x);
+extern int lnc_mvaddch(int y, int x, unsigned long ch)
+{
+    return mvwaddch(stdscr, y, x, ch);
+}
 
-    lua_pushnumber(L, y);
-    lua_pushnumber(L, x);
-    return 2;
+extern int lnc_werase(WINDOW* win)
+{
+    return werase(win);
 }
 
-static int l_getyx(lua_State* L)
+extern int lnc_wnoutrefresh(WINDOW* win)
 {
-    int x, y;
+    return wnoutrefresh(win);
+}
 
-    getyx(stdscr, y, x);
+extern int lnc_wrefresh(WINDOW* win)
+{
+    if (wnoutrefresh(win) == ERR) {
+        return ERR;
+    }
+    return update_screen();
+}
 
-    lua_pushnumber(L, y);
-    lua_pushnumber(L, x);
-    return 2;
+extern int lnc_doupdate(void)
+{
+    return update_screen();
 }
 
-static int l_colors(lua_State* L)
+extern int lnc_wgetch(WINDOW* win)
 {
-    lua_pushinteger(L, COLORS);
-    return 1;
+    flush_before_input(win);
+    sync_modes();
+    return wgetch(win);
 }
 
-static int l_color_pairs(lua_State* L)
+extern int lnc_getch(void)
 {
-    lua_pushinteger(L, COLOR_PAIRS);
-    return 1;
+    return lnc_wgetch(stdscr);
 }
 
+const luaL_Reg window_reg[] = {
+    { "move", l_move },
+    { "addch", l_addch },
+    { "mvaddch", l_mvaddch },
+    { "echochar", l_echochar },
+    { "addstr", l_addstr },
+    { "mvaddstr", l_mvaddstr },
+    { "erase", l_erase },
+    { "clear", l_clear },
+    { "clrtobot", l_clrtobot },
+    { "clrtoeol", l_clrtoeol },
+    { "delch", l_delch },
+    { "mvdelch", l_mvdelch },
+    { "deleteln", l_deleteln },
+    { "insch", l_insch },
+    { "mvinsch", l_mvinsch },
+    { "insstr", l_insstr },
+    { "mvinsstr", l_mvinsstr },
+    { "insdelln", l_insdelln },
+    { "insertln", l_insertln },
+    { "getch", l_getch },
+    { "mvgetch", l_mvgetch },
+    { "getch_all", l_getch_all },
+    { "setup_term", l_setup_term },
+    { "refresh", l_refresh },
+    { "noutrefresh", l_noutrefresh },
+    { "touch", l_touch },
+    { "getmaxyx", l_getmaxyx },
+    { "getyx", l_getyx },
+    { "getbegyx", l_getbegyx },
+    { "subwin", l_subwin },
+    { "derwin", l_derwin },
+    { "mvwin", l_mvwin },
+    { "resize", l_resize },
+    { "delwin", l_delwin },
+    { "subpad", l_subpad },
+    { "prefresh", l_prefresh },
+    { "pnoutrefresh", l_pnoutrefresh },
+    { "putwin", l_putwin },
+    { "instr", l_instr },
+    { "inchstr", l_inchstr },
+    { "fill", l_fill },
+    { "clear_rect", l_clear_rect },
+    { "addtext", l_addtext },
+    { "copywin", l_copywin },
+    { "overlay", l_overlay },
+    { "overwrite", l_overwrite },
+    { "bkgd", l_bkgd },
+    { "bkgdset", l_bkgdset },
+    { NULL, NULL },
+};
+
+const luaL_Reg screen_reg[] = {
+    { "set_term", l_set_term },
+    { "delscreen", l_delscreen },
+    { NULL, NULL },
+};
+
+const luaL_Reg cellbuf_reg[] = {
+    { "size", l_cellbuf_size },
+    { "fill", l_cellbuf_fill },
+    { "set", l_cellbuf_set },
+    { "get", l_cellbuf_get },
+    { "put", l_cellbuf_put },
+    { "blit", l_cellbuf_blit },
+    { NULL, NULL },
+};
+
+const luaL_Reg drawlist_reg[] = {
+    { "move", l_drawlist_move },
+    { "addstr", l_drawlist_addstr },
+    { "mvaddstr", l_drawlist_mvaddstr },
+    { "addch", l_drawlist_addch },
+    { "mvaddch", l_drawlist_mvaddch },
+    { "fill", l_drawlist_fill },
+    { "border", l_drawlist_border },
+    { "clear", l_drawlist_clear },
+    { "size", l_drawlist_size },
+    { "draw", l_drawlist_draw },
+    { NULL, NULL },
+};
+
 const luaL_Reg reg[] = {
     { "initscr", l_initscr },
+    { "newterm", l_newterm },
+    { "set_term", l_set_term },
+    { "delscreen", l_delscreen },
     { "endwin", l_endwin },
     { "isendwin", l_isendwin },
     { "start_color", l_start_color },
@@ -685,41 +4901,147 @@ const luaL_Reg reg[] = {
     { "setup_term", l_setup_term },
     { "init_color", l_init_color },
     { "init_pair", l_init_pair },
+    { "alloc_pair", l_alloc_pair },
+    { "free_pair", l_free_pair },
     { "getch", l_getch },
+    { "mvgetch", l_mvgetch },
+    { "getch_all", l_getch_all },
+    { "keyname", l_keyname },
+    { "input_fd", l_input_fd },
+    { "output_stats", l_output_stats },
+    { "profile", l_profile },
+    { "profile_report", l_profile_report },
+    { "flush", l_flush },
+    { "update_pending", l_update_pending },
     { "ungetch", l_ungetch },
+    { "mousemask", l_mousemask },
+    { "mouseinterval", l_mouseinterval },
+    { "has_mouse", l_has_mouse },
+    { "getmouse", l_getmouse },
     { "move", l_move },
     { "addch", l_addch },
+    { "mvaddch", l_mvaddch },
     { "echochar", l_echochar },
     { "addstr", l_addstr },
+    { "mvaddstr", l_mvaddstr },
     { "erase", l_erase },
     { "clear", l_clear },
     { "clrtobot", l_clrtobot },
     { "clrtoeol", l_clrtoeol },
     { "delch", l_delch },
+    { "mvdelch", l_mvdelch },
     { "deleteln", l_deleteln },
     { "insch", l_insch },
+    { "mvinsch", l_mvinsch },
     { "insstr", l_insstr },
+    { "mvinsstr", l_mvinsstr },
     { "insdelln", l_insdelln },
     { "insertln", l_insertln },
     { "refresh", l_refresh },
+    { "noutrefresh", l_noutrefresh },
+    { "doupdate", l_doupdate },
+    { "commit", l_commit },
+    { "touch", l_touch },
     { "getmaxyx", l_getmaxyx },
     { "getyx", l_getyx },
+    { "getbegyx", l_getbegyx },
+    { "resizeterm", l_resizeterm },
+    { "is_term_resized", l_is_term_resized },
+    { "stdscr", l_stdscr },
+    { "newwin", l_newwin },
+    { "subwin", l_subwin },
+    { "derwin", l_derwin },
+    { "mvwin", l_mvwin },
+    { "resize", l_resize },
+    { "delwin", l_delwin },
+    { "newpad", l_newpad },
+    { "subpad", l_subpad },
+    { "prefresh", l_prefresh },
+    { "pnoutrefresh", l_pnoutrefresh },
+    { "putwin", l_putwin },
+    { "getwin", l_getwin },
+    { "scr_dump", l_scr_dump },
+    { "scr_restore", l_scr_restore },
+    { "scr_init", l_scr_init },
+    { "scr_set", l_scr_set },
     { "colors", l_colors },
     { "color_pairs", l_color_pairs },
+    { "style", l_style },
+    { "strwidth", l_strwidth },
     { "beep", l_beep },
     { "flash", l_flash },
+    { "cellbuf", l_cellbuf },
+    { "drawlist", l_drawlist },
+    { "instr", l_instr },
+    { "inchstr", l_inchstr },
+    { "fill", l_fill },
+    { "clear_rect", l_clear_rect },
+    { "addtext", l_addtext },
+    { "copywin", l_copywin },
+    { "overlay", l_overlay },
+    { "overwrite", l_overwrite },
+    { "bkgd", l_bkgd },
+    { "bkgdset", l_bkgdset },
     { NULL, NULL },
 };
 
 extern int luaopen_curses(lua_State* L)
 {
+    const char* str;
+
+    /* the name tables and their hashes have to be kept in step by hand */
+    if ((str = check_hashes()) != NULL) {
+        return luaL_error(L, "curses: \"%s\" doesn't hash to its own slot",
+                          str);
+    }
+
+    init_screen(&initscr_screen);
+    cur_screen = &initscr_screen;
+
     lua_newtable(L);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -3, "initscr_state");
+    lua_setfield(L, -2, "screen_state");
     lua_setfield(L, LUA_REGISTRYINDEX, REG_TABLE);
 
+    luaL_newmetatable(L, SCREEN_TABLE);
+    lua_newtable(L);
+    luaL_register(L, NULL, screen_reg);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_screen_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, WINDOW_TABLE);
+    lua_newtable(L);
+    luaL_register(L, NULL, window_reg);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_window_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, CELLBUF_TABLE);
+    lua_newtable(L);
+    luaL_register(L, NULL, cellbuf_reg);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, DRAWLIST_TABLE);
+    lua_newtable(L);
+    luaL_register(L, NULL, drawlist_reg);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, l_drawlist_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     luaL_register(L, "curses", reg);
     lua_getglobal(L, "curses");
     lua_pushstring(L, "LuaNcurses 0.02");
     lua_setfield(L, -2, "_VERSION");
 
+    init_key_names(L);
+    init_key_codes(L);
+
     return 1;
 }
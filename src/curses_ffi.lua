@@ -0,0 +1,160 @@
+-- fast paths for the hot drawing and input functions under luajit. these call
+-- the lnc_* entry points in curses.so through the ffi, so render loops using
+-- them can be compiled. everything else falls through to the curses module,
+-- and all state (the screen, colors, styles) is shared with it.
+--
+--   local curses = require "curses_ffi"
+--   curses.mvaddstr(y, x, str, curses.style{color = "red"})
+--
+-- styles should be precompiled with curses.style; tables work, but compiling
+-- them on every call defeats the point. windows may be passed as the first
+-- argument to the w* variants (wmvaddstr, wgetch, etc).
+local ffi = require "ffi"
+local bit = require "bit"
+local curses = require "curses"
+
+ffi.cdef[[
+typedef struct _win_st WINDOW;
+typedef struct { WINDOW* win; } lnc_window;
+
+WINDOW* lnc_stdscr(void);
+unsigned long lnc_char(const char* str);
+int lnc_wmove(WINDOW* win, int y, int x);
+int lnc_waddnstr(WINDOW* win, const char* str, int n, unsigned long attr);
+int lnc_mvwaddnstr(WINDOW* win, int y, int x, const char* str, int n,
+                   unsigned long attr);
+int lnc_mvaddnstr(int y, int x, const char* str, int n, unsigned long attr);
+int lnc_mvwaddch(WINDOW* win, int y, int x, unsigned long ch);
+int lnc_mvaddch(int y, int x, unsigned long ch);
+int lnc_werase(WINDOW* win);
+int lnc_wnoutrefresh(WINDOW* win);
+int lnc_wrefresh(WINDOW* win);
+int lnc_doupdate(void);
+int lnc_wgetch(WINDOW* win);
+int lnc_getch(void);
+]]
+
+-- load the same library the curses module came from, so that the state is
+-- shared
+local lib = ffi.load(assert(package.searchpath("curses", package.cpath)))
+
+local ERR = -1
+local style = curses.style
+local M = setmetatable({}, {__index = curses})
+
+local function get_style(s)
+    if s == nil then
+        return 0
+    elseif type(s) == "table" then
+        -- like a table passed to the c functions, this mustn't pin the pair
+        return style(s, false)
+    end
+    return s
+end
+
+local window_mt = debug.getregistry()["luancurses.window"]
+
+local function get_win(w)
+    if type(w) ~= "userdata" or getmetatable(w) ~= window_mt then
+        error("bad argument #1 (window expected, got " .. type(w) .. ")", 3)
+    end
+    local win = ffi.cast("lnc_window*", w).win
+    if win == nil then
+        error("Attempt to use a deleted window", 3)
+    end
+    return win
+end
+
+-- single characters by name, as addch takes them. the acs names aren't
+-- cached, since what they map to depends on the terminal, and isn't known
+-- at all before initscr
+local chars = setmetatable({}, {__index = function(t, name)
+    local ch = tonumber(lib.lnc_char(name))
+    if #name == 1 then
+        t[name] = ch
+    end
+    return ch
+end})
+
+-- combines a character with a style. bit.bor works on signed 32 bit
+-- numbers, so the result has to be made positive again for the c side
+local function with_style(ch, s)
+    local v = bit.bor(ch, s)
+    if v < 0 then
+        v = v + 2^32
+    end
+    return v
+end
+
+-- key names by code, as getch returns them
+local keys = setmetatable({}, {__index = function(t, code)
+    local name = curses.keyname(code)
+    t[code] = name
+    return name
+end})
+
+function M.mvaddstr(y, x, str, s)
+    return lib.lnc_mvaddnstr(y, x, str, #str, get_style(s)) ~= ERR
+end
+
+function M.wmvaddstr(w, y, x, str, s)
+    return lib.lnc_mvwaddnstr(get_win(w), y, x, str, #str, get_style(s)) ~= ERR
+end
+
+function M.waddstr(w, str, s)
+    return lib.lnc_waddnstr(get_win(w), str, #str, get_style(s)) ~= ERR
+end
+
+function M.mvaddch(y, x, ch, s)
+    return lib.lnc_mvaddch(y, x, with_style(chars[ch], get_style(s))) ~= ERR
+end
+
+function M.wmvaddch(w, y, x, ch, s)
+    return lib.lnc_mvwaddch(get_win(w), y, x,
+                            with_style(chars[ch], get_style(s))) ~= ERR
+end
+
+function M.move(y, x)
+    return lib.lnc_wmove(lib.lnc_stdscr(), y, x) ~= ERR
+end
+
+function M.wmove(w, y, x)
+    return lib.lnc_wmove(get_win(w), y, x) ~= ERR
+end
+
+function M.erase(w)
+    return lib.lnc_werase(w and get_win(w) or lib.lnc_stdscr()) ~= ERR
+end
+
+-- refresh and noutrefresh only take windows here, not pads
+function M.refresh(w)
+    return lib.lnc_wrefresh(w and get_win(w) or lib.lnc_stdscr()) ~= ERR
+end
+
+function M.noutrefresh(w)
+    return lib.lnc_wnoutrefresh(w and get_win(w) or lib.lnc_stdscr()) ~= ERR
+end
+
+function M.doupdate()
+    return lib.lnc_doupdate() ~= ERR
+end
+
+-- getch returns key names, regardless of the keycodes setting, and getch_code
+-- returns the raw codes. both return false if no key was available
+function M.getch(w)
+    local c = lib.lnc_wgetch(w and get_win(w) or lib.lnc_stdscr())
+    if c == ERR then
+        return false
+    end
+    return keys[c]
+end
+
+function M.getch_code(w)
+    local c = lib.lnc_wgetch(w and get_win(w) or lib.lnc_stdscr())
+    if c == ERR then
+        return false
+    end
+    return c
+end
+
+return M
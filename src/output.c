@@ -0,0 +1,575 @@
+#include "output.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+/* ncurses writes straight to the file descriptor behind the output stream it
+ * is given, and sets the terminal modes on that same descriptor, so there is
+ * no way to see its output by wrapping the stream. instead, we give it the
+ * slave side of a pty to draw on, and relay everything which comes out of the
+ * master side to the real terminal from a separate thread, counting it as it
+ * goes. the input and local modes ncurses sets on the pty are mirrored onto
+ * the real terminal, which is still where input is read from.
+ *
+ * the relay takes everything out of the pty as soon as it arrives, into a
+ * buffer of its own, so that ncurses never blocks on a full pty however far
+ * behind the real terminal is (the pty itself only holds a few kilobytes).
+ * the buffer is written out as the terminal can take it, which needs a
+ * descriptor of our own for it in non-blocking mode. that is only possible
+ * for a terminal, which can be opened again by name; for anything else,
+ * writes may block the relay, and a large enough frame can back up into
+ * ncurses as before. nothing is ever dropped from the buffer, since the
+ * output is a stream of escape sequences rather than separate frames, but
+ * it doesn't grow by more than about a frame, since async refreshes are put
+ * off while earlier output is still on its way (see output_busy) */
+struct _term_output {
+    int fd;     /* the real terminal */
+    int wfd;    /* what the relay writes to: fd, or a non-blocking copy */
+    int master;
+    int slave;
+    int stop[2]; /* written to when the relay should finish up and exit */
+
+    int has_orig;
+    struct termios orig;    /* the real terminal's modes before we started */
+    struct termios applied; /* what we last set them to */
+
+    pthread_t relay_thread;
+    pthread_mutex_t lock;
+    pthread_cond_t idle;
+    int inflight; /* bytes the relay has read, but not yet written out */
+    char* buf;    /* the relay's buffer, holding them from off up to len */
+    size_t off;
+    size_t len;
+    size_t size;
+    int closed;
+    int async;
+
+    unsigned long refresh_start;
+    output_stats stats;
+
+    term_output* next;
+};
+
+static term_output* outputs = NULL;
+static int winch_installed = 0;
+static struct sigaction old_winch;
+
+static int write_all(int fd, const char* buf, size_t len)
+{
+    int writes = 0;
+
+    while (len > 0) {
+        ssize_t n;
+
+        n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd pfd;
+
+                pfd.fd = fd;
+                pfd.events = POLLOUT;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            break;
+        }
+
+        writes++;
+        buf += n;
+        len -= n;
+    }
+
+    return writes;
+}
+
+/* makes room in the relay's buffer for another read from the pty */
+static int reserve(term_output* out, size_t n)
+{
+    if (out->off > 0 && out->off == out->len) {
+        out->off = out->len = 0;
+    }
+    if (out->size - out->len >= n) {
+        return 0;
+    }
+    if (out->off > 0) {
+        memmove(out->buf, out->buf + out->off, out->len - out->off);
+        out->len -= out->off;
+        out->off = 0;
+    }
+    if (out->size - out->len < n) {
+        size_t size = out->size ? out->size : 16384;
+        char* buf;
+
+        while (size - out->len < n) {
+            size *= 2;
+        }
+        buf = realloc(out->buf, size);
+        if (buf == NULL) {
+            return -1;
+        }
+        out->buf = buf;
+        out->size = size;
+    }
+
+    return 0;
+}
+
+/* takes whatever is in the pty into the buffer. returns -1 once the pty is
+ * empty (or gone) and the relay is stopping, 0 otherwise */
+static int relay_read(term_output* out, int stopping)
+{
+    ssize_t n;
+
+    /* take data out of the pty under the lock, so that every byte written
+     * to it is always either still in the pty, in flight, or counted */
+    pthread_mutex_lock(&out->lock);
+    if (reserve(out, 4096) != 0) {
+        /* leave it in the pty until the terminal catches up */
+        pthread_mutex_unlock(&out->lock);
+        return 0;
+    }
+    n = read(out->master, out->buf + out->len, out->size - out->len);
+    if (n > 0) {
+        out->len += n;
+        out->inflight += n;
+    }
+    pthread_mutex_unlock(&out->lock);
+
+    if (n <= 0) {
+        /* once asked to stop, keep going until the pty is empty */
+        if (n < 0 && (errno == EINTR || (errno == EAGAIN && !stopping))) {
+            return 0;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+/* sends as much of the buffer as the terminal will take without blocking
+ * (or all of it, if all is set) */
+static void relay_write(term_output* out, int all)
+{
+    size_t len;
+    int writes;
+
+    len = out->len - out->off;
+    if (len == 0) {
+        return;
+    }
+
+    if (all) {
+        writes = write_all(out->wfd, out->buf + out->off, len);
+    }
+    else {
+        ssize_t n;
+
+        n = write(out->wfd, out->buf + out->off, len);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                return;
+            }
+            /* the terminal has gone; there's nowhere for it to go */
+            n = len;
+            writes = 0;
+        }
+        else {
+            writes = 1;
+        }
+        len = n;
+    }
+
+    pthread_mutex_lock(&out->lock);
+    out->off += len;
+    out->inflight -= len;
+    out->stats.bytes += len;
+    out->stats.writes += writes;
+    pthread_cond_broadcast(&out->idle);
+    pthread_mutex_unlock(&out->lock);
+}
+
+static void* relay(void* data)
+{
+    term_output* out = data;
+    int stopping = 0;
+
+    for (;;) {
+        struct pollfd pfd[3];
+        int npfd = 2;
+
+        pfd[0].fd = out->master;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = out->stop[0];
+        pfd[1].events = POLLIN;
+        if (out->len > out->off) {
+            pfd[2].fd = out->wfd;
+            pfd[2].events = POLLOUT;
+            npfd = 3;
+        }
+        if (poll(pfd, npfd, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (pfd[1].revents) {
+            stopping = 1;
+        }
+
+        if ((pfd[0].revents || stopping) && relay_read(out, stopping) != 0) {
+            break;
+        }
+        if (npfd == 3 && pfd[2].revents) {
+            relay_write(out, 0);
+        }
+    }
+
+    relay_write(out, 1);
+
+    pthread_mutex_lock(&out->lock);
+    out->inflight = 0;
+    out->closed = 1;
+    pthread_cond_broadcast(&out->idle);
+    pthread_mutex_unlock(&out->lock);
+
+    return NULL;
+}
+
+/* the pty needs to be told when the real terminal changes size, before
+ * ncurses' own handler goes looking for the new size. ncurses only installs
+ * its handler if there isn't one already, so ours has to go in after */
+static void handle_winch(int sig, siginfo_t* info, void* context)
+{
+    term_output* out;
+    int saved_errno;
+
+    saved_errno = errno;
+    for (out = outputs; out != NULL; out = out->next) {
+        struct winsize ws;
+
+        if (ioctl(out->fd, TIOCGWINSZ, &ws) == 0) {
+            ioctl(out->slave, TIOCSWINSZ, &ws);
+        }
+    }
+    errno = saved_errno;
+
+    if (old_winch.sa_flags & SA_SIGINFO) {
+        old_winch.sa_sigaction(sig, info, context);
+    }
+    else if (old_winch.sa_handler != SIG_DFL &&
+             old_winch.sa_handler != SIG_IGN) {
+        old_winch.sa_handler(sig);
+    }
+}
+
+void output_hook_resize(void)
+{
+    struct sigaction sa;
+
+    if (winch_installed) {
+        return;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = handle_winch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    if (sigaction(SIGWINCH, &sa, &old_winch) == 0) {
+        winch_installed = 1;
+    }
+}
+
+static int open_pty(term_output* out)
+{
+    const char* name;
+
+    out->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (out->master < 0) {
+        return -1;
+    }
+    if (grantpt(out->master) != 0 || unlockpt(out->master) != 0 ||
+        (name = ptsname(out->master)) == NULL) {
+        close(out->master);
+        return -1;
+    }
+
+    out->slave = open(name, O_RDWR | O_NOCTTY);
+    if (out->slave < 0) {
+        close(out->master);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* a terminal can be opened again, giving a descriptor of our own which can
+ * be made non-blocking without affecting whoever else is using it */
+static int open_nonblocking(int fd)
+{
+    const char* name;
+    int wfd;
+
+    if (!isatty(fd) || (name = ttyname(fd)) == NULL) {
+        return fd;
+    }
+    wfd = open(name, O_WRONLY | O_NOCTTY | O_NONBLOCK);
+
+    return wfd < 0 ? fd : wfd;
+}
+
+static void close_wfd(term_output* out)
+{
+    if (out->wfd != out->fd) {
+        close(out->wfd);
+    }
+}
+
+term_output* output_open(int fd)
+{
+    term_output* out;
+    sigset_t all, old;
+
+    out = calloc(1, sizeof(term_output));
+    if (out == NULL) {
+        return NULL;
+    }
+    out->fd = fd;
+    out->wfd = open_nonblocking(fd);
+
+    if (pipe(out->stop) != 0) {
+        close_wfd(out);
+        free(out);
+        return NULL;
+    }
+    if (open_pty(out) != 0) {
+        close(out->stop[0]);
+        close(out->stop[1]);
+        close_wfd(out);
+        free(out);
+        return NULL;
+    }
+    /* only the relay reads from the master, and only after poll says it can,
+     * but it mustn't ever block while holding the lock */
+    fcntl(out->master, F_SETFL, fcntl(out->master, F_GETFL) | O_NONBLOCK);
+
+    /* the pty starts out looking like the real terminal, so that ncurses
+     * saves the right shell modes and finds the right size. if the real
+     * output isn't a terminal, ncurses will fall back to the terminfo size */
+    if (tcgetattr(fd, &out->orig) == 0) {
+        struct winsize ws;
+
+        out->has_orig = 1;
+        out->applied = out->orig;
+        tcsetattr(out->slave, TCSANOW, &out->orig);
+        if (ioctl(fd, TIOCGWINSZ, &ws) == 0) {
+            ioctl(out->slave, TIOCSWINSZ, &ws);
+        }
+    }
+
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->idle, NULL);
+
+    /* signals should be handled by the main thread, not the relay */
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&out->relay_thread, NULL, relay, out) != 0) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        pthread_cond_destroy(&out->idle);
+        pthread_mutex_destroy(&out->lock);
+        close(out->slave);
+        close(out->master);
+        close(out->stop[0]);
+        close(out->stop[1]);
+        close_wfd(out);
+        free(out);
+        return NULL;
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    out->next = outputs;
+    outputs = out;
+
+    return out;
+}
+
+void output_close(term_output* out)
+{
+    term_output** link;
+
+    for (link = &outputs; *link != NULL; link = &(*link)->next) {
+        if (*link == out) {
+            *link = out->next;
+            break;
+        }
+    }
+
+    if (outputs == NULL && winch_installed) {
+        sigaction(SIGWINCH, &old_winch, NULL);
+        winch_installed = 0;
+    }
+
+    output_sync_modes(out, 0);
+
+    /* the relay sends whatever is left in the pty before exiting */
+    while (write(out->stop[1], "", 1) < 0 && errno == EINTR);
+    pthread_join(out->relay_thread, NULL);
+    close(out->slave);
+    close(out->master);
+    close(out->stop[0]);
+    close(out->stop[1]);
+    close_wfd(out);
+
+    pthread_cond_destroy(&out->idle);
+    pthread_mutex_destroy(&out->lock);
+    free(out->buf);
+    free(out);
+}
+
+int output_term_fd(term_output* out)
+{
+    return out->slave;
+}
+
+/* while curses is active, the real terminal gets the input handling ncurses
+ * asked the pty for, but no output processing, since the pty has already
+ * done that. outside of curses, it goes back to how we found it */
+void output_sync_modes(term_output* out, int in_curses)
+{
+    struct termios want;
+
+    if (!out->has_orig) {
+        return;
+    }
+
+    want = out->orig;
+    if (in_curses) {
+        struct termios pty;
+
+        if (tcgetattr(out->slave, &pty) != 0) {
+            return;
+        }
+        want.c_iflag = pty.c_iflag;
+        want.c_lflag = pty.c_lflag;
+        memcpy(want.c_cc, pty.c_cc, sizeof(want.c_cc));
+        want.c_oflag &= ~OPOST;
+    }
+
+    if (memcmp(&want, &out->applied, sizeof(want)) != 0) {
+        if (tcsetattr(out->fd, TCSANOW, &want) == 0) {
+            out->applied = want;
+        }
+    }
+}
+
+/* how much is waiting to be read from the master. data written to the slave
+ * only shows up there once the kernel gets around to passing it across, but
+ * polling makes it do that first, which FIONREAD alone doesn't */
+static int pending(term_output* out)
+{
+    struct pollfd pfd;
+    int n = 0;
+
+    pfd.fd = out->master;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & POLLIN)) {
+        return 0;
+    }
+    if (ioctl(out->master, FIONREAD, &n) != 0) {
+        return 0;
+    }
+
+    return n;
+}
+
+/* everything written to the pty so far, whether or not it has reached the
+ * real terminal yet. must be called with the lock held */
+static unsigned long produced(term_output* out)
+{
+    return out->stats.bytes + out->inflight + pending(out);
+}
+
+static void wait_idle(term_output* out)
+{
+    while (!out->closed && (out->inflight > 0 || pending(out) > 0)) {
+        pthread_cond_wait(&out->idle, &out->lock);
+    }
+}
+
+/* in async mode, refreshes return as soon as their output is in the pty,
+ * rather than waiting for it to reach the real terminal */
+void output_set_async(term_output* out, int async)
+{
+    pthread_mutex_lock(&out->lock);
+    out->async = async;
+    pthread_mutex_unlock(&out->lock);
+}
+
+int output_is_async(term_output* out)
+{
+    return out->async;
+}
+
+/* whether earlier output is still on its way to the real terminal */
+int output_busy(term_output* out)
+{
+    int ret;
+
+    pthread_mutex_lock(&out->lock);
+    ret = !out->closed && (out->inflight > 0 || pending(out) > 0);
+    pthread_mutex_unlock(&out->lock);
+
+    return ret;
+}
+
+void output_wait(term_output* out)
+{
+    pthread_mutex_lock(&out->lock);
+    wait_idle(out);
+    pthread_mutex_unlock(&out->lock);
+}
+
+void output_begin_refresh(term_output* out)
+{
+    pthread_mutex_lock(&out->lock);
+    out->refresh_start = produced(out);
+    pthread_mutex_unlock(&out->lock);
+}
+
+/* unless we're in async mode, wait for everything the refresh wrote to reach
+ * the real terminal, so that refreshing still blocks the way it would without
+ * us in the way */
+void output_end_refresh(term_output* out)
+{
+    unsigned long bytes;
+    int bucket;
+
+    pthread_mutex_lock(&out->lock);
+    bytes = produced(out) - out->refresh_start;
+    if (!out->async) {
+        wait_idle(out);
+    }
+
+    for (bucket = 0; bucket < OUTPUT_HISTOGRAM_SIZE - 1 && bytes >> bucket;
+         ++bucket);
+    out->stats.histogram[bucket]++;
+    out->stats.last_refresh = bytes;
+    out->stats.refreshes++;
+    pthread_mutex_unlock(&out->lock);
+}
+
+void output_get_stats(term_output* out, output_stats* stats)
+{
+    pthread_mutex_lock(&out->lock);
+    *stats = out->stats;
+    pthread_mutex_unlock(&out->lock);
+}
@@ -0,0 +1,32 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/* histogram[i] counts refreshes which wrote at least 2^(i-1) bytes but less
+ * than 2^i (histogram[0] counts refreshes which wrote nothing) */
+#define OUTPUT_HISTOGRAM_SIZE 24
+
+typedef struct _term_output term_output;
+
+typedef struct _output_stats {
+    unsigned long bytes;
+    unsigned long writes;
+    unsigned long refreshes;
+    unsigned long last_refresh;
+    unsigned long histogram[OUTPUT_HISTOGRAM_SIZE];
+} output_stats;
+
+term_output* output_open(int fd);
+void output_close(term_output* out);
+int output_term_fd(term_output* out);
+void output_hook_resize(void);
+
+void output_sync_modes(term_output* out, int in_curses);
+void output_set_async(term_output* out, int async);
+int output_is_async(term_output* out);
+int output_busy(term_output* out);
+void output_wait(term_output* out);
+void output_begin_refresh(term_output* out);
+void output_end_refresh(term_output* out);
+void output_get_stats(term_output* out, output_stats* stats);
+
+#endif
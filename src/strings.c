@@ -47,47 +47,49 @@ static trans keys[] = {
     {"break",     KEY_BREAK},
     {"delete",    KEY_DC},
     {"insert",    KEY_IC},
+    {"mouse",     KEY_MOUSE},
+    {"resize",    KEY_RESIZE},
 };
 
-/* XXX: the ACS_ defines are actually just indexes into another internal array,
- * which means that we can't use them as initializers. think of a better way
- * to do this. */
-/*
+/* the ACS_ defines are actually just indexes into another internal array which
+ * isn't filled in until initscr is called, so we can't use them as
+ * initializers. the tags here are filled in by init_chars instead. */
 static trans chars[] = {
-    {"block",    ACS_BLOCK},
-    {"board",    ACS_BOARD},
-    {"btee",     ACS_BTEE},
-    {"bullet",   ACS_BULLET},
-    {"ckboard",  ACS_CKBOARD},
-    {"darrow",   ACS_DARROW},
-    {"degree",   ACS_DEGREE},
-    {"diamond",  ACS_DIAMOND},
-    {"gequal",   ACS_GEQUAL},
-    {"hline",    ACS_HLINE},
-    {"lantern",  ACS_LANTERN},
-    {"larrow",   ACS_LARROW},
-    {"lequal",   ACS_LEQUAL},
-    {"llcorner", ACS_LLCORNER},
-    {"lrcorner", ACS_LRCORNER},
-    {"ltee",     ACS_LTEE},
-    {"nequal",   ACS_NEQUAL},
-    {"pi",       ACS_PI},
-    {"plminus",  ACS_PLMINUS},
-    {"plus",     ACS_PLUS},
-    {"rarrow",   ACS_RARROW},
-    {"rtee",     ACS_RTEE},
-    {"s1",       ACS_S1},
-    {"s3",       ACS_S3},
-    {"s7",       ACS_S7},
-    {"s9",       ACS_S9},
-    {"sterling", ACS_STERLING},
-    {"ttee",     ACS_TTEE},
-    {"uarrow",   ACS_UARROW},
-    {"ulcorner", ACS_ULCORNER},
-    {"urcorner", ACS_URCORNER},
-    {"vline",    ACS_VLINE},
+    {"block",    0},
+    {"board",    0},
+    {"btee",     0},
+    {"bullet",   0},
+    {"ckboard",  0},
+    {"darrow",   0},
+    {"degree",   0},
+    {"diamond",  0},
+    {"gequal",   0},
+    {"hline",    0},
+    {"lantern",  0},
+    {"larrow",   0},
+    {"lequal",   0},
+    {"llcorner", 0},
+    {"lrcorner", 0},
+    {"ltee",     0},
+    {"nequal",   0},
+    {"pi",       0},
+    {"plminus",  0},
+    {"plus",     0},
+    {"rarrow",   0},
+    {"rtee",     0},
+    {"s1",       0},
+    {"s3",       0},
+    {"s7",       0},
+    {"s9",       0},
+    {"sterling", 0},
+    {"ttee",     0},
+    {"uarrow",   0},
+    {"ulcorner", 0},
+    {"urcorner", 0},
+    {"vline",    0},
 };
-*/
+
+static int chars_initialized = 0;
 
 static const char* fn_keys[] = {
     "F0",  "F1",  "F2",  "F3",  "F4",  "F5",  "F6",  "F7",
@@ -100,17 +102,95 @@ static const char* fn_keys[] = {
     "F56", "F57", "F58", "F59", "F60", "F61", "F62", "F63",
 };
 
-static int str2enum(const trans table[], int len, const char* str)
+/* name lookups use perfect hashes: each table has a seed for which every name
+ * hashes to a different slot, and the slot holds the index of that name in the
+ * table (or -1). if you add a name to a table, you'll need to find a new seed
+ * (and possibly a bigger slot array) for which this is still true.
+ * check_hashes makes sure of that when the module is loaded. */
+typedef struct _trans_hash {
+    unsigned int seed;
+    unsigned int mask;
+    const signed char* slots;
+} trans_hash;
+
+static const signed char colors_slots[16] = {
+     6, -1,  5, -1, -1, -1,  4, -1,  1,  0,  7,  2, -1, -1, -1,  3,
+};
+static const signed char modes_slots[32] = {
+    -1, -1,  4, -1,  1, -1,  6,  9,  5,  3, -1, -1,  7, -1, -1, -1,
+    -1,  8, -1, -1, -1, -1, -1, -1, -1,  0, -1, -1, -1, -1,  2, -1,
+};
+static const signed char keys_slots[32] = {
+    14, -1, -1,  7, -1,  8, -1, -1, -1,  0,  6,  9, -1, -1, -1,  3,
+    10, -1, -1,  4, -1, 11,  1, -1, 13,  2, -1, -1, -1, -1, 12,  5,
+};
+static const signed char chars_slots[64] = {
+    -1, 20, -1, 24, 11, -1, 19, -1, -1, -1, -1, 16, -1, 25, 17, 23,
+    12, 10,  0, -1, -1, 28, -1, -1, -1, -1,  6, -1, 13, 18,  1, 27,
+    -1, -1, 31, -1, -1, 22, 14,  2, 29, -1,  5, -1, -1,  7, 26,  4,
+     3, -1, 30, -1,  9, -1, 15, -1,  8, -1, -1, 21, -1, -1, -1, -1,
+};
+static const trans_hash colors_hash = { 0x1, 16 - 1, colors_slots };
+static const trans_hash modes_hash = { 0xa, 32 - 1, modes_slots };
+static const trans_hash keys_hash = { 0x2, 32 - 1, keys_slots };
+static const trans_hash chars_hash = { 0x807, 64 - 1, chars_slots };
+
+/* names for the codes between KEY_MIN and KEY_MAX, filled in on first use */
+static const char* key_names[KEY_MAX - KEY_MIN + 1];
+static int key_names_initialized = 0;
+
+static unsigned int hash_str(const char* str, unsigned int seed)
+{
+    unsigned int h = seed;
+
+    while (*str) {
+        h = ((h ^ (unsigned char)*str++) * 16777619u) & 0xffffffffu;
+    }
+
+    return h ^ (h >> 16);
+}
+
+static int str2enum(const trans table[], const trans_hash* hash,
+                    const char* str)
+{
+    int i;
+
+    i = hash->slots[hash_str(str, hash->seed) & hash->mask];
+    if (i >= 0 && !strcmp(str, table[i].str)) {
+        return table[i].tag;
+    }
+
+    return -1;
+}
+
+static const char* check_hash(const trans table[], int len,
+                              const trans_hash* hash)
 {
     int i;
 
     for (i = 0; i < len; ++i) {
-        if (!strcmp(str, table[i].str)) {
-            return table[i].tag;
+        if (hash->slots[hash_str(table[i].str, hash->seed) & hash->mask]
+            != i) {
+            return table[i].str;
         }
     }
 
-    return -1;
+    return NULL;
+}
+
+/* returns the first name which doesn't hash to its own slot, or NULL */
+const char* check_hashes(void)
+{
+    const char* str;
+
+    if ((str = check_hash(colors, lengthof(colors), &colors_hash)) ||
+        (str = check_hash(modes, lengthof(modes), &modes_hash)) ||
+        (str = check_hash(keys, lengthof(keys), &keys_hash)) ||
+        (str = check_hash(chars, lengthof(chars), &chars_hash))) {
+        return str;
+    }
+
+    return NULL;
 }
 
 static const char* enum2str(const trans* table, int len, int tag)
@@ -135,25 +215,76 @@ static void each_item(const trans* table, int len, table_cb cb, void* data)
     }
 }
 
+static void init_key_names(void)
+{
+    int i;
+
+    for (i = 0; i < lengthof(keys); ++i) {
+        key_names[keys[i].tag - KEY_MIN] = keys[i].str;
+    }
+    for (i = 0; i < lengthof(fn_keys); ++i) {
+        key_names[KEY_F(i) - KEY_MIN] = fn_keys[i];
+    }
+
+    key_names_initialized = 1;
+}
+
+/* this has to be called after initscr, since that is what sets up the ACS_
+ * values. the values here need to be in the same order as the chars table. */
+void init_chars(void)
+{
+    chtype acs[] = {
+        ACS_BLOCK,    ACS_BOARD,    ACS_BTEE,     ACS_BULLET,
+        ACS_CKBOARD,  ACS_DARROW,   ACS_DEGREE,   ACS_DIAMOND,
+        ACS_GEQUAL,   ACS_HLINE,    ACS_LANTERN,  ACS_LARROW,
+        ACS_LEQUAL,   ACS_LLCORNER, ACS_LRCORNER, ACS_LTEE,
+        ACS_NEQUAL,   ACS_PI,       ACS_PLMINUS,  ACS_PLUS,
+        ACS_RARROW,   ACS_RTEE,     ACS_S1,       ACS_S3,
+        ACS_S7,       ACS_S9,       ACS_STERLING, ACS_TTEE,
+        ACS_UARROW,   ACS_ULCORNER, ACS_URCORNER, ACS_VLINE,
+    };
+    int i;
+
+    for (i = 0; i < lengthof(chars); ++i) {
+        chars[i].tag = acs[i];
+    }
+
+    chars_initialized = 1;
+}
+
 int get_color_enum(const char* str)
 {
-    return str2enum(colors, lengthof(colors), str);
+    return str2enum(colors, &colors_hash, str);
 }
 
 int get_mode_enum(const char* str)
 {
-    return str2enum(modes, lengthof(modes), str);
+    return str2enum(modes, &modes_hash, str);
 }
 
 int get_key_enum(const char* str)
 {
     int ret;
 
-    ret = str2enum(keys, lengthof(keys), str);
+    if (str[0] == '\0' || str[1] == '\0') {
+        return (int)str[0];
+    }
+
+    ret = str2enum(keys, &keys_hash, str);
 
-    if (ret == -1) {
+    /* function keys are F0 through F63 */
+    if (ret == -1 && str[0] == 'F' && str[1] >= '0' && str[1] <= '9') {
         int fkey;
-        if (sscanf(str, "F%d", &fkey) == 1) {
+
+        fkey = str[1] - '0';
+        if (str[2] >= '0' && str[2] <= '9' && str[3] == '\0') {
+            fkey = fkey * 10 + str[2] - '0';
+        }
+        else if (str[2] != '\0') {
+            fkey = -1;
+        }
+
+        if (fkey >= 0 && fkey < lengthof(fn_keys)) {
             return KEY_F(fkey);
         }
     }
@@ -163,14 +294,15 @@ int get_key_enum(const char* str)
 
 int get_char_enum(const char* str)
 {
-    /*
     int ret;
 
-    ret = str2enum(chars, lengthof(chars), str);
+    if (str[0] == '\0' || str[1] == '\0' || !chars_initialized) {
+        return (int)str[0];
+    }
+
+    ret = str2enum(chars, &chars_hash, str);
 
     return ret == -1 ? (int)str[0] : ret;
-    */
-    return (int)str[0];
 }
 
 const char* get_color_str(int tag)
@@ -185,19 +317,24 @@ const char* get_mode_str(int tag)
 
 const char* get_key_str(int tag)
 {
-    if (tag >= KEY_F(0) && tag <= KEY_F(63)) {
-        return fn_keys[tag - KEY_F0];
+    if (tag < KEY_MIN || tag > KEY_MAX) {
+        return NULL;
+    }
+
+    if (!key_names_initialized) {
+        init_key_names();
     }
 
-    return enum2str(keys, lengthof(keys), tag);
+    return key_names[tag - KEY_MIN];
 }
 
 const char* get_char_str(int tag)
 {
-    /*
+    if (!chars_initialized) {
+        return NULL;
+    }
+
     return enum2str(chars, lengthof(chars), tag);
-    */
-    return NULL;
 }
 
 void each_color(table_cb cb, void* data)
@@ -217,7 +354,7 @@ void each_key(table_cb cb, void* data)
 
 void each_char(table_cb cb, void* data)
 {
-    /*
-    each_item(chars, lengthof(chars), cb, data);
-    */
+    if (chars_initialized) {
+        each_item(chars, lengthof(chars), cb, data);
+    }
 }
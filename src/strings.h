@@ -3,6 +3,9 @@
 
 typedef void (*table_cb)(const char* str, int tag, void* data);
 
+void init_chars(void);
+const char* check_hashes(void);
+
 int get_color_enum(const char* str);
 int get_mode_enum(const char* str);
 int get_key_enum(const char* str);
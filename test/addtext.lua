@@ -0,0 +1,48 @@
+-- checks for how addtext lays text out. the terminal is opened headlessly
+-- with newterm, writing to /dev/null, so this can run without a tty. each
+-- case draws some text into a rectangle and compares what ended up on the
+-- screen, row by row. prints the cases which fail, and exits with an error
+-- if there were any.
+--
+-- usage: lua addtext.lua
+require "curses"
+
+if not curses.newterm("xterm", "/dev/null", "/dev/null") then
+    io.stderr:write("couldn't open terminal\n")
+    os.exit(1)
+end
+
+local cases = {
+    {"wraps at spaces", 12, "the quick brown fox jumps", nil,
+     {"the quick", "brown fox", "jumps"}},
+    {"breaks long words", 8, "supercalifragilistic", {ellipsis = false},
+     {"supercal", "ifragili", "stic"}},
+    {"breaks after the indentation", 8, "  indented text here", nil,
+     {"", "indented", "text", "here"}},
+    {"keeps the indentation of a long word", 8, "  supercalifragilistic",
+     {ellipsis = false}, {"  superc", "alifragi", "listic"}},
+    {"aligns right", 8, "ab cd", {align = "right"}, {"   ab cd"}},
+}
+
+local failed = 0
+for _, case in ipairs(cases) do
+    local name, w, text, opts, want = unpack(case)
+    local rect = {y = 0, x = 0, h = #want + 1, w = w}
+    curses.clear_rect(rect)
+    curses.addtext(rect, text, opts)
+
+    for row, line in ipairs(want) do
+        local got = curses.instr({y = row - 1, x = 0, h = 1, w = w})
+        got = got:gsub(" +$", "")
+        if got ~= line then
+            print(string.format("%s: row %d is %q, not %q", name, row, got,
+                                line))
+            failed = failed + 1
+        end
+    end
+end
+
+curses.endwin()
+if failed > 0 then
+    os.exit(1)
+end
@@ -0,0 +1,145 @@
+-- benchmarks for the binding's hot paths. the terminal is opened headlessly
+-- with newterm, writing to /dev/null, so this can run without a tty. results
+-- are printed as tab separated values: name, calls, calls per second and
+-- nanoseconds per call.
+--
+-- usage: lua bench.lua [seconds per benchmark] [pattern]
+require "curses"
+
+local min_time = tonumber(arg[1]) or 0.5
+local pattern = arg[2]
+
+local term = os.getenv("TERM")
+if not term or term == "" or term == "dumb" then
+    term = "xterm"
+end
+if not curses.newterm(term, "/dev/null", "/dev/null") then
+    io.stderr:write("couldn't open terminal of type " .. term .. "\n")
+    os.exit(1)
+end
+curses.start_color()
+curses.init_pair("red", "red")
+curses.setup_term{nl = false, cbreak = true, echo = false, keypad = true,
+                  typeahead = false}
+
+local maxy, maxx = curses.getmaxyx()
+local line = string.rep("x", maxx)
+local style_table = {color = "red", bold = true}
+local style = curses.style(style_table)
+
+-- each benchmark is a function which makes n calls
+local benchmarks = {
+    {"addch", function(n)
+        for i = 1, n do
+            if i % 1000 == 0 then curses.move(0, 0) end
+            curses.addch("x")
+        end
+    end},
+    {"addch_style", function(n)
+        for i = 1, n do
+            if i % 1000 == 0 then curses.move(0, 0) end
+            curses.addch("x", style_table)
+        end
+    end},
+    {"addstr", function(n)
+        for i = 1, n do
+            if i % 16 == 0 then curses.move(0, 0) end
+            curses.addstr("hello, world")
+        end
+    end},
+    {"addstr_style", function(n)
+        for i = 1, n do
+            if i % 16 == 0 then curses.move(0, 0) end
+            curses.addstr("hello, world", style_table)
+        end
+    end},
+    {"addstr_precompiled_style", function(n)
+        for i = 1, n do
+            if i % 16 == 0 then curses.move(0, 0) end
+            curses.addstr("hello, world", style)
+        end
+    end},
+    {"addstr_pos_table", function(n)
+        for i = 1, n do
+            curses.addstr({y = i % maxy, x = 0}, "hello, world")
+        end
+    end},
+    {"mvaddstr", function(n)
+        for i = 1, n do
+            curses.mvaddstr(i % maxy, 0, "hello, world")
+        end
+    end},
+    {"frame_mvaddstr_style", function(n)
+        for i = 1, n do
+            for j = 0, 199 do
+                curses.mvaddstr(j % maxy, j % 4 * 16, "hello, world", style)
+            end
+        end
+    end},
+    {"frame_drawlist", function(n)
+        local dl = curses.drawlist()
+        for j = 0, 199 do
+            dl:mvaddstr(j % maxy, j % 4 * 16, "hello, world", style)
+        end
+        for i = 1, n do
+            dl:draw()
+        end
+    end},
+    {"move", function(n)
+        for i = 1, n do
+            curses.move(i % maxy, i % maxx)
+        end
+    end},
+    {"getch_ungetch", function(n)
+        for i = 1, n do
+            curses.ungetch("a")
+            curses.getch()
+        end
+    end},
+    {"repaint_refresh", function(n)
+        local lines = {string.rep("x", maxx), string.rep("o", maxx)}
+        for i = 1, n do
+            local l = lines[i % 2 + 1]
+            for y = 0, maxy - 1 do
+                curses.move(y, 0)
+                curses.addstr(l)
+            end
+            curses.refresh()
+        end
+    end},
+}
+
+-- run the benchmark in batches, growing them until they take long enough
+-- to time reliably, then until the total time is at least min_time
+local function run(f)
+    local n, calls, elapsed = 1, 0, 0
+    while elapsed < min_time do
+        local start = os.clock()
+        f(n)
+        local t = os.clock() - start
+        calls = calls + n
+        elapsed = elapsed + t
+        if t < min_time / 10 then
+            n = n * 2
+        end
+    end
+    return calls, elapsed
+end
+
+local results = {}
+for _, b in ipairs(benchmarks) do
+    local name, f = b[1], b[2]
+    if not pattern or name:find(pattern) then
+        curses.erase()
+        local calls, elapsed = run(f)
+        table.insert(results, {name, calls, elapsed})
+    end
+end
+curses.endwin()
+
+print("benchmark\tcalls\tcalls_per_sec\tns_per_call")
+for _, r in ipairs(results) do
+    local name, calls, elapsed = r[1], r[2], r[3]
+    print(string.format("%s\t%d\t%.0f\t%.1f", name, calls, calls / elapsed,
+                        elapsed * 1e9 / calls))
+end
@@ -13,12 +13,12 @@ local colors = {
 
 -- helpful functions {{{
 local function pline(str)
-    curses.addstr({y = 0, x = 0}, str)
+    curses.mvaddstr(0, 0, str)
     curses.clrtoeol()
 end
 
 local function botl(str)
-    curses.addstr({y = rows - 1, x = 0}, str)
+    curses.mvaddstr(rows - 1, 0, str)
     curses.clrtoeol()
 end
 
@@ -36,7 +36,8 @@ end
 curses.initscr();
 curses.start_color();
 curses.use_default_colors();
-curses.setup_term{nl = false, cbreak = true, echo = false, keypad = true}
+curses.setup_term{nl = false, cbreak = true, echo = false, keypad = true,
+                  resize_delay = 100}
 for _, color in ipairs(colors) do
     curses.init_pair(color, color)
 end
@@ -47,18 +48,18 @@ signal.signal("TERM", cleanup)
 signal.signal("INT",  cleanup)
 -- }}}
 
--- get the term size and the size of the map we want to draw {{{
-rows, cols = curses.getmaxyx()
-map = {ul = {x = 0, y = 1}, lr = {x = cols - 1, y = rows - 3}}
-map.w = map.lr.x - map.ul.x + 1
-map.h = map.lr.y - map.ul.y + 1
--- }}}
+-- get the term size and the size of the map we want to draw, and draw it.
+-- this is done again whenever the terminal is resized {{{
+local function layout()
+    rows, cols = curses.getmaxyx()
+    map = {ul = {x = 0, y = 1}, lr = {x = cols - 1, y = rows - 3}}
+    map.w = map.lr.x - map.ul.x + 1
+    map.h = map.lr.y - map.ul.y + 1
 
--- draw the screen {{{
-curses.clear()
-for i = map.ul.y, map.lr.y do
-    curses.addstr({y = i, x = map.ul.x}, ("."):rep(map.w))
+    curses.clear()
+    curses.fill({y = map.ul.y, x = map.ul.x, h = map.h, w = map.w}, ".")
 end
+layout()
 -- }}}
 
 -- initialize the character {{{
@@ -112,6 +113,10 @@ while true do
     pline("")
     if directions[c] then
         turns = turns + char:move(directions[c])
+    elseif c == "resize" then
+        layout()
+        char.x = math.min(char.x, map.lr.x)
+        char.y = math.min(char.y, map.lr.y)
     elseif (c == "Q") then
         break
     else
@@ -31,6 +31,10 @@ while true do
         y = y - 1
     elseif c == "down" and y < maxy - 1 then
         y = y + 1
+    elseif c == "resize" then
+        maxy, maxx = curses.getmaxyx()
+        y = math.min(y, maxy - 1)
+        x = math.min(x, maxx - 1)
     elseif #c == 1 then
         curses.addch(c, {color = colors[math.random(#colors)]})
     end
@@ -7,6 +7,7 @@ local unpack   = unpack
 
 require 'curses'
 local addstr   = curses.addstr
+local mvaddstr = curses.mvaddstr
 local addch    = curses.addch
 local clrtoeol = curses.clrtoeol
 local move     = curses.move
@@ -68,7 +69,7 @@ end
 function draw(self)
     -- draw the board
     for i, line in ipairs(board_background) do
-        addstr({y = self.yorig + i - 1, x = self.xorig}, line)
+        mvaddstr(self.yorig + i - 1, self.xorig, line)
     end
 
     -- draw the x's and o's